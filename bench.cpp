@@ -0,0 +1,184 @@
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "gcapi.h"
+using namespace std;
+
+// Timings behind the performance claims of the allocator's features.
+// Run with no argument for all of them, or name the ones to run.
+
+static double seconds(chrono::steady_clock::time_point since)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - since).count();
+}
+
+enum { BatchCount = 1000000 };
+
+struct Small {
+  long words[6];
+};
+
+// Fill an array with 1M 48-byte objects by a malloc loop, then by one
+// xxmalloc_batch call. The array is itself an object, not a global that
+// every collection in the other cases would scan.
+static void benchBatch()
+{
+  auto smalls = (Small **) calloc(BatchCount, sizeof(Small *));
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < BatchCount; i++) {
+    smalls[i] = (Small *) malloc(sizeof(Small));
+  }
+  auto loop = seconds(start);
+  memset(smalls, 0, BatchCount * sizeof(Small *));
+  start = chrono::steady_clock::now();
+  gcmalloc::allocateBatch(BatchCount, smalls);
+  auto batch = seconds(start);
+  cout << "batch: malloc loop " << loop * 1000 << " ms, xxmalloc_batch "
+       << batch * 1000 << " ms (" << loop / batch << "x)" << endl;
+}
+
+enum { Fibers = 5000, FiberStackSize = 256 * 1024 };
+
+static ucontext_t mainContext;
+static ucontext_t * fiberContexts;
+static xxgc_fiber ** fiberHandles;
+static int currentFiber;
+
+static void parkedFiber()
+{
+  int i = currentFiber;
+  if (fiberHandles[i] != nullptr) {
+    xxgc_fiber_suspend(fiberHandles[i], nullptr, &fiberContexts[i], sizeof(ucontext_t));
+  }
+  swapcontext(&fiberContexts[i], &mainContext);
+}
+
+// Park 5000 fibers on 256 KB stacks from malloc, then time full
+// collections. Unregistered, each stack is scanned in full as an
+// ordinary object; registered and suspended, only its live part is.
+static void runFibers(bool registered)
+{
+  auto stacks = (char **) malloc(Fibers * sizeof(char *));
+  fiberContexts = (ucontext_t *) mmap(nullptr, Fibers * sizeof(ucontext_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  fiberHandles = (xxgc_fiber **) calloc(Fibers, sizeof(xxgc_fiber *));
+  for (int i = 0; i < Fibers; i++) {
+    stacks[i] = (char *) malloc(FiberStackSize);
+    if (registered) {
+      fiberHandles[i] = xxgc_fiber_register(stacks[i], FiberStackSize);
+    }
+    getcontext(&fiberContexts[i]);
+    fiberContexts[i].uc_stack.ss_sp = stacks[i];
+    fiberContexts[i].uc_stack.ss_size = FiberStackSize;
+    fiberContexts[i].uc_link = nullptr;
+    makecontext(&fiberContexts[i], parkedFiber, 0);
+    currentFiber = i;
+    swapcontext(&mainContext, &fiberContexts[i]);
+  }
+  // malloc_trim collects in full every time.
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < 20; i++) {
+    malloc_trim(0);
+  }
+  cout << "fibers: " << Fibers << (registered ? " registered" : " unregistered")
+       << " parked fibers, " << seconds(start) * 1000 / 20 << " ms per collection" << endl;
+}
+
+// Each case in a process of its own, so neither inherits the other's heap.
+static void benchFibers()
+{
+  for (int registered = 0; registered < 2; registered++) {
+    auto pid = fork();
+    if (pid == 0) {
+      runFibers(registered);
+      _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+  }
+}
+
+enum { ThreadOps = 4000000, ThreadLive = 64 };
+
+// Small mallocs and frees, keeping a few dozen objects live.
+static void * churnThread(void *)
+{
+  void * live[ThreadLive] = { nullptr };
+  for (int i = 0; i < ThreadOps; i++) {
+    auto & slot = live[i % ThreadLive];
+    free(slot);
+    slot = malloc(16 + (i * 7) % 240);
+  }
+  for (auto p : live) {
+    free(p);
+  }
+  return nullptr;
+}
+
+// Run the malloc/free loop in 1, 2, 4 and 8 threads at once, each count
+// in a process of its own, and report the total throughput.
+static void benchThreads()
+{
+  double single = 0;
+  for (int n = 1; n <= 8; n *= 2) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      return;
+    }
+    auto pid = fork();
+    if (pid == 0) {
+      pthread_t threads[8];
+      auto start = chrono::steady_clock::now();
+      for (int i = 0; i < n; i++) {
+	pthread_create(&threads[i], nullptr, churnThread, nullptr);
+      }
+      for (int i = 0; i < n; i++) {
+	pthread_join(threads[i], nullptr);
+      }
+      double rate = n * (double) ThreadOps / seconds(start);
+      auto unused = write(fds[1], &rate, sizeof(rate));
+      (void) unused;
+      _exit(0);
+    }
+    double rate = 0;
+    auto got = read(fds[0], &rate, sizeof(rate));
+    waitpid(pid, nullptr, 0);
+    close(fds[0]);
+    close(fds[1]);
+    if (got != sizeof(rate)) {
+      continue;
+    }
+    if (n == 1) {
+      single = rate;
+    }
+    cout << "threads: " << n << " x malloc/free, " << rate / 1e6 << " M ops/s ("
+	 << (single ? rate / single : 0) << "x one thread)" << endl;
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  struct {
+    const char * name;
+    void (*run)();
+  } benches[] = {
+    { "batch", benchBatch },
+    { "fibers", benchFibers },
+    { "threads", benchThreads },
+  };
+  for (auto & b : benches) {
+    bool wanted = (argc == 1);
+    for (int i = 1; i < argc; i++) {
+      wanted |= (strcmp(argv[i], b.name) == 0);
+    }
+    if (wanted) {
+      b.run();
+    }
+  }
+  return 0;
+}
@@ -1,20 +1,37 @@
 #include "gcmalloc.hh"
-#include "mmapheap.h"
+#include "regionheap.h"
+#include "gcapi.h"
 
 #include "gcmalloc.cpp"
 
-const auto HeapSize = 1024UL * 1024 * 1024;
-class HeapType : public GCMalloc<MmapHeap<HeapSize>> {};
+// The heap grows in 64 MB regions, up to 64 GB unless GCMALLOC_MAX_HEAP says otherwise.
+const auto LogRegionSize = 26;
+const auto DefaultMaxHeap = 64UL * 1024 * 1024 * 1024;
+class HeapType : public GCMalloc<RegionHeap<LogRegionSize, DefaultMaxHeap>> {};
+
+extern "C" void * xxloader_text[2];
+
+// The dynamic loader's code, for the wrapper's inline check; empty
+// until the heap starts, before which the loader has nothing to note.
+void * xxloader_text[2];
+
+static HeapType * startHeap(void * buf) {
+  auto h = new (buf) HeapType;
+  auto text = h->getLoaderText();
+  xxloader_text[0] = text.first;
+  xxloader_text[1] = text.second;
+  return h;
+}
 
 static HeapType& getHeap() {
   static char theHeapBuf[sizeof(HeapType)];
-  static HeapType * h = new (theHeapBuf) HeapType;
+  static HeapType * h = startHeap(theHeapBuf);
   return *h;
 }
 
 extern "C" {
 
-  void walk(std::function< void(Header *) > f)
+  void walk(std::function< void(void *) > f)
   {
     getHeap().walk(f);
   }
@@ -24,6 +41,26 @@ extern "C" {
     return getHeap().malloc(sz);
   }
   
+  size_t xxmalloc_batch(size_t sz, size_t count, void ** out)
+  {
+    return getHeap().mallocBatch(sz, count, out);
+  }
+
+  void * xxcalloc(size_t nelem, size_t elsize)
+  {
+    return getHeap().calloc(nelem, elsize);
+  }
+
+  void * xxrealloc(void * ptr, size_t sz)
+  {
+    return getHeap().realloc(ptr, sz);
+  }
+
+  void * xxmemalign(size_t alignment, size_t sz)
+  {
+    return getHeap().memalign(alignment, sz);
+  }
+
   void xxfree(void * ptr) {
     getHeap().free(ptr);
   }
@@ -31,7 +68,78 @@ extern "C" {
   size_t xxmalloc_usable_size(void * ptr) {
     return getHeap().getSize(ptr);
   }
+
+  void xxmalloc_stats() {
+    getHeap().printStats();
+  }
+
+  int xxmalloc_trim(size_t) {
+    return getHeap().trim() > 0;
+  }
+
+  size_t xxmalloc_good_size(size_t sz) {
+    return HeapType::getGoodSize(sz);
+  }
   
+  int xxgc_add_roots(void * start, void * end)
+  {
+    return getHeap().addRoots(start, end);
+  }
+
+  int xxgc_remove_roots(void * start, void * end)
+  {
+    return getHeap().removeRoots(start, end);
+  }
+
+  int xxgc_exclude_roots(void * start, void * end)
+  {
+    return getHeap().excludeRoots(start, end);
+  }
+
+  xxgc_fiber * xxgc_fiber_register(void * stack, size_t size)
+  {
+    return (xxgc_fiber *) getHeap().registerFiber(stack, size);
+  }
+
+  void xxgc_fiber_unregister(xxgc_fiber * f)
+  {
+    getHeap().unregisterFiber((HeapType::Fiber *) f);
+  }
+
+  void xxgc_fiber_suspend(xxgc_fiber * f, void * sp, void * regs, size_t len)
+  {
+    HeapType::suspendFiber((HeapType::Fiber *) f, sp, regs, len);
+  }
+
+  void xxgc_fiber_resume(xxgc_fiber * f)
+  {
+    HeapType::resumeFiber((HeapType::Fiber *) f);
+  }
+
+  int xxpthread_create(pthread_t * thread, const pthread_attr_t * attr,
+		       void *(*start)(void *), void * arg)
+  {
+    return getHeap().createThread(thread, attr, start, arg);
+  }
+
+  int xxpthread_sigmask(int how, const sigset_t * set, sigset_t * old)
+  {
+    return OSSpecific::setSignalMask(how, set, old, false);
+  }
+
+  int xxsigprocmask(int how, const sigset_t * set, sigset_t * old)
+  {
+    return OSSpecific::setSignalMask(how, set, old, true);
+  }
+
+  void xxmalloc_note(void * ptr, void * caller) {
+    getHeap().noteAllocation(ptr, caller);
+  }
+
+  void xxfree_note(void * ptr, void * caller) {
+    getHeap().noteFree(ptr, caller);
+  }
+
   void xxmalloc_lock() {
   }
   
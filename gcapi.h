@@ -0,0 +1,71 @@
+#ifndef GCAPI_H
+#define GCAPI_H
+
+// Entry points of libgcmalloc beyond the standard malloc family.
+// Include this from programs linked against (or preloading) the library.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  // A fiber (user-space thread) registered with the collector.
+  typedef struct xxgc_fiber xxgc_fiber;
+
+  // Allocates up to count objects of at least sz bytes each into out,
+  // under one lock acquisition. Returns how many were allocated (fewer
+  // than count only when memory runs out). Keep out reachable: the
+  // collector only sees the objects through it.
+  size_t xxmalloc_batch (size_t sz, size_t count, void ** out);
+
+  // Scans [start, end) for pointers in every collection, as the globals
+  // are, until removed: for memory the collector does not otherwise
+  // see, such as a mapping of the program's own. Returns 0 if there are
+  // too many ranges.
+  int xxgc_add_roots (void * start, void * end);
+
+  // Stops scanning the parts of [start, end) that xxgc_add_roots added.
+  // Once it returns, no collection is scanning them, so they may be
+  // unmapped. Returns 0 if splitting a range needs too many.
+  int xxgc_remove_roots (void * start, void * end);
+
+  // Leaves [start, end), part of the program's globals, out of every
+  // collection from now on: for static data that holds no pointers into
+  // the heap. Returns 0 if there are too many ranges.
+  int xxgc_exclude_roots (void * start, void * end);
+
+  // Registers a fiber running on the stack [stack, stack + size), which
+  // may have come from malloc: while registered, the stack stays alive
+  // and is scanned as a root. Returns NULL when out of memory.
+  xxgc_fiber * xxgc_fiber_register (void * stack, size_t size);
+
+  // Forgets a fiber; its stack is then only as alive as any object.
+  void xxgc_fiber_unregister (xxgc_fiber * f);
+
+  // Call on the fiber's thread just before switching away from it. sp is
+  // the lowest address of its stack still in use (NULL: the caller's
+  // frame), and [regs, regs + len) where the switch saves its registers
+  // (len 0 if they go on its stack). While suspended, only [sp, top)
+  // and the saved registers are scanned.
+  void xxgc_fiber_suspend (xxgc_fiber * f, void * sp, void * regs, size_t len);
+
+  // Call on the fiber's stack once it runs again.
+  void xxgc_fiber_resume (xxgc_fiber * f);
+
+#ifdef __cplusplus
+}
+
+namespace gcmalloc {
+
+  // Allocates count uninitialized objects of type T into out.
+  // Returns how many were allocated.
+  template <class T>
+  size_t allocateBatch(size_t count, T ** out) {
+    return xxmalloc_batch(sizeof(T), count, (void **) out);
+  }
+
+}
+#endif
+
+#endif
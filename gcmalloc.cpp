@@ -1,234 +1,637 @@
 #define GC_THRESHOLD 524288
-#define LIMIT_16KB 16384
-#define LIMIT_512MB 536870912
-#define CLASS_16KB 1024
-#define CLASS_512MB 1039
-#define LOG_LIMIT_16KB 14
+#define CLASS_16KB (SizeClass::SmallClasses - 1)
 #define PTR_SIZE sizeof(void*)
 
 /***********************************************************************************************
- This part deals with aligning all memory chunks to the boundary defined by the enum Alignment.
- The class-sizes of the segregated memory allocator does not take header size into consideration.
- Since it is always a multiple of enum Alignment, it is always aligned.
- Now it is only required to add an offset to the header's size to make the header always aligned.
- Making both the header and usable-memory independently aligned makes the allocator very portable
- and easy to maintain.
- Calculation of offset is inspired by Doug Lea's memory allocator.
+ Every object starts on the boundary defined by the enum Alignment: spans and large objects are
+ page-aligned and every size class is a multiple of Alignment.
  ************************************************************************************************/
 
 #define MEM_ALIGN_MASK (Alignment - (size_t)1)
 
 #define is_aligned(X) (((size_t)((X)) & (MEM_ALIGN_MASK)) == 0)
 
-#define calc_align_offset(X) \
-  (is_aligned(X) ? 0 : \
-    ((Alignment - ((size_t)(X) & MEM_ALIGN_MASK)) & MEM_ALIGN_MASK))
+#define PAGES(X) (((X) + PageRun::PageSize - 1) >> PageRun::PageShift)
 
-#define HEADER_ORIG_SIZE sizeof(Header)
+/***********************************************************************************************/
 
-#define HEADER_ALIGNED_SIZE (HEADER_ORIG_SIZE + calc_align_offset(HEADER_ORIG_SIZE))
 
-/***********************************************************************************************/
 
 
+template <class SourceHeap>
+__thread typename GCMalloc<SourceHeap>::ThreadCache * GCMalloc<SourceHeap>::threadCache
+	__attribute__((tls_model("initial-exec"))) = NULL;
 
+template <class SourceHeap>
+GCMalloc<SourceHeap> *GCMalloc<SourceHeap>::forkHeap = NULL;
 
 template <class SourceHeap>
 GCMalloc<SourceHeap>::GCMalloc()
-	: bytesAllocatedSinceLastGC (0),
+	: markerCount (1),
+	markersStarted (false),
+	markRound (0),
+	markersBusy (0),
+	idleMarkers (0),
+	markStackOverflowed (false),
+	concurrentMarking (false),
+	markingConcurrently (false),
+	lazySweeping (false),
+	sweeperStarted (false),
+	sweepPending (false),
+	unsweptCount (0),
+	unsweptLarge (NULL),
+	sweepEpoch (true),
+	sweepRound (0),
+	incrementalMarking (false),
+	markBudget (0),
+	sliceAllocated (0),
+	allCaches (NULL),
+	freeCaches (NULL),
+	threadStarts (NULL),
+	fibers (NULL),
+	worldStopped (false),
+	trackGlobals (false),
+	loaderObjects (NULL),
+	loaderObjectCount (0),
+	bytesAllocatedSinceLastGC (0),
 	bytesReclaimedLastGC (0),
 	objectsAllocated (0),
 	allocated (0),
-	allocatedObjects (NULL),
+	collections (0),
+	markTime (0),
+	sweepTime (0),
+	pauseTime (0),
+	maxPause (0),
+	maxRemark (0),
+	largeObjects (NULL),
+	allSpans (NULL),
+	markEpoch (true),
 	inGC (false),
 	nextGC (GC_THRESHOLD)
  {
-
-	startHeap = endHeap = SourceHeap::getStart();
-	for (auto& f : freedObjects) {
-	        f = NULL;
+	hugeLow = hugeHigh = NULL;
+	for (auto& s : partialSpans) {
+	        s = NULL;
+	}
+	for (auto& s : unsweptSpans)
+		s = NULL;
+	if (!pageHeap.initialize(this)) {
+		initialized = false;
+		return;
+	}
+	pthread_key_create(&cacheKey, releaseThreadCache);
+	/* This heap's own state lies among the globals, but its pointers into
+	 * the heap are not references */
+	sp.excludeRoots(this, this + 1);
+#if !defined(__APPLE__)
+	/* Find the loader's code before it allocates through us again */
+	sp.initialize();
+	/* Threads with a cache stop for collections in suspendHandler */
+	struct sigaction act;
+	sem_init(&stopAck, 0, 0);
+	memset(&act, 0, sizeof(act));
+	sigemptyset(&act.sa_mask);
+	sigaddset(&act.sa_mask, OSSpecific::RestartSignal);
+	act.sa_flags = SA_RESTART | SA_SIGINFO;
+	act.sa_sigaction = suspendHandler;
+	sigaction(OSSpecific::SuspendSignal, &act, NULL);
+	act.sa_flags = SA_RESTART;
+	act.sa_handler = restartHandler;
+	sigaction(OSSpecific::RestartSignal, &act, NULL);
+#endif
+	/* Marking threads, the collecting one included */
+	auto env = getenv("GCMALLOC_MARKERS");
+	auto n = env ? atoi(env) : OSSpecific::availableProcessors();
+	markerCount = (n < 1) ? 1 : (n > MaxMarkers) ? MaxMarkers : n;
+	env = getenv("GCMALLOC_CONCURRENT");
+	concurrentMarking = env && atoi(env) > 0;
+	env = getenv("GCMALLOC_LAZY_SWEEP");
+	lazySweeping = env && atoi(env) > 0;
+	env = getenv("GCMALLOC_PAUSE_US");
+	markBudget = env ? strtoull(env, NULL, 10) * 1000 : 0;
+	for (unsigned i = 0; i < MaxMarkers; i++) {
+		markers[i].heap = this;
+		markers[i].id = i;
 	}
+	forkHeap = this;
+	pthread_atfork(prepareFork, parentAfterFork, childAfterFork);
 	initialized = true;
  }
 
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::prepareFork()
+{
+	GCMalloc *heap = forkHeap;
+
+	/* A concurrent mark runs without heapLock: wait until it is over */
+	for (;;) {
+		heap->heapLock.lock();
+		if (!heap->inGC)
+			break;
+		heap->heapLock.unlock();
+		sched_yield();
+	}
+	/* The child has no sweeper to finish a lazy sweep */
+	heap->finishSweep();
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::parentAfterFork()
+{
+	forkHeap->heapLock.unlock();
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::childAfterFork()
+{
+	GCMalloc *heap = forkHeap;
+
+	/* heapLock names its owner by the parent's thread, and the markers
+	 * were idle but may have held their lock: neither can be unlocked
+	 * here, so start both afresh */
+	new (&heap->heapLock) recursive_mutex;
+	new (&heap->markerLock) mutex;
+	new (&heap->markerWake) condition_variable;
+	new (&heap->markerDone) condition_variable;
+	/* New markers wait for a round after the zeroth */
+	heap->markRound = 0;
+	heap->markersBusy = 0;
+	heap->idleMarkers = 0;
+	heap->markersStarted = false;
+	/* Nor does it have the sweeper, which prepareFork left nothing to do */
+	new (&heap->sweepLock) mutex;
+	new (&heap->sweepWake) condition_variable;
+	heap->sweepRound = 0;
+	heap->sweeperStarted = false;
+}
+
 template <class SourceHeap>
 void *GCMalloc<SourceHeap>::malloc(size_t sz)
 {
 	int class_index;
-	size_t rounded_sz, total_sz;
-	void *heap_mem;
-	Header *mem_chunk;
+	ThreadCache *tc;
+	void *ptr;
 
-	if (initialized && !inGC && triggerGC(sz))
-		gc();
+	if (!initialized)
+		return NULL;
 
 	class_index = getSizeClass(sz);
 	if (class_index < 0)
 		return NULL;
 
-	/* round to the next class size */
-	rounded_sz = getSizeFromClass(class_index);
-	if (!rounded_sz)
-		return NULL;
+	/* Creating the cache also registers the thread with the collector */
+	tc = getThreadCache();
+
+	/* Fast path: pop from this thread's cache without taking any lock */
+	if (class_index <= CLASS_16KB && tc) {
+		ptr = tc->freeList[class_index];
+		if (!ptr) {
+			if (!refillCache(tc, class_index))
+				return NULL;
+			ptr = tc->freeList[class_index];
+		}
+		tc->freeList[class_index] = *(void**)ptr;
+		return ptr;
+	}
+
+	heapLock.lock();
+	maybeCollect(sz);
+	if (class_index <= CLASS_16KB)
+		ptr = allocateSmall(class_index);
+	else
+		ptr = allocateLarge(sz);
+	heapLock.unlock();
+	return ptr;
+}
+
+template <class SourceHeap>
+size_t GCMalloc<SourceHeap>::mallocBatch(size_t sz, size_t count, void **out)
+{
+	int class_index;
+	size_t n;
+
+	if (!initialized || !count)
+		return 0;
+	class_index = getSizeClass(sz);
+	if (class_index < 0)
+		return 0;
 
-	/* We try to get memory from the free list.
-	* If the corresponding free list has no chunks left,
-	* we look for memory from the SourceHeap.
-	*/
+	getThreadCache();
+	/* One lock round-trip and one gc check for the whole batch */
 	heapLock.lock();
-	mem_chunk = freedObjects[class_index];
-	if(mem_chunk) {
-		/*remove the first chunk from this free list and give
-		* it to the caller */
-		freedObjects[class_index] = mem_chunk->nextObject;
-		if (mem_chunk->nextObject) {
-			freedObjects[class_index]->prevObject = NULL;
+	maybeCollect(sz);
+	if (class_index <= CLASS_16KB) {
+		n = allocateBatch(class_index, count, out);
+	} else {
+		for (n = 0; n < count; n++) {
+			out[n] = allocateLarge(sz);
+			if (!out[n])
+				break;
 		}
-		goto out;
 	}
+	heapLock.unlock();
+	return n;
+}
 
-	total_sz = HEADER_ALIGNED_SIZE + rounded_sz;
-	heap_mem = SourceHeap::malloc(total_sz);
-	endHeap = (char*)heap_mem + total_sz;
-	if (!heap_mem) {
-		perror("Out of Memory!!");
+template <class SourceHeap>
+void *GCMalloc<SourceHeap>::calloc(size_t nelem, size_t elsize)
+{
+	size_t sz;
+	void *ptr;
+
+	sz = nelem * elsize;
+	if (elsize && nelem != sz / elsize)
+		return NULL;
+	if (getSizeClass(sz) < 0)
+		return NULL;
+
+	/* Small objects are recycled slot by slot, so just clear them */
+	if (sz <= Threshold) {
+		ptr = malloc(sz);
+		if (ptr)
+			memset(ptr, 0, sz);
+		return ptr;
+	}
+
+	if (!initialized)
+		return NULL;
+	getThreadCache();
+	heapLock.lock();
+	maybeCollect(sz);
+	ptr = allocateLarge(sz, PageRun::PageSize, true);
+	heapLock.unlock();
+	return ptr;
+}
+
+template <class SourceHeap>
+void *GCMalloc<SourceHeap>::realloc(void *ptr, size_t sz)
+{
+	PageRun *run;
+	LargeObject *lo = NULL;
+	size_t old_sz;
+	void *buf;
+
+	if (!ptr)
+		return malloc(sz);
+	if (getSizeClass(sz) < 0)
+		return NULL;
+
+	heapLock.lock();
+	if (!initialized || findObject(ptr, &run) != ptr) {
 		heapLock.unlock();
 		return NULL;
 	}
-	mem_chunk = (Header*) heap_mem;
-	mem_chunk->setCookie();
-	mem_chunk->setAllocatedSize(rounded_sz);
-	/* Pedantic: make sure mark bit is cleared */
-	mem_chunk->clear();
-
-out:
-	/* Connect it to the doubly linked list tailed by @allocatedObjects */
-	if (!allocatedObjects) {
-		allocatedObjects = mem_chunk;
-		mem_chunk->prevObject = mem_chunk->nextObject = NULL;
+	if (run->kind == PageRun::SmallRun) {
+		old_sz = ((Span*)run)->objectSize;
 	} else {
-		allocatedObjects->nextObject = mem_chunk;
-		mem_chunk->prevObject = allocatedObjects;
-		mem_chunk->nextObject = NULL;
-		allocatedObjects = mem_chunk;
+		lo = (LargeObject*)run;
+		old_sz = lo->objectSize;
 	}
 
-	/* A little stats */
-	allocated += rounded_sz;
-	bytesAllocatedSinceLastGC += rounded_sz;
-	objectsAllocated += 1;
+	/* Still fits and is not shrinking by more than half: keep it as is */
+	if (sz <= old_sz && sz > old_sz / 2) {
+		heapLock.unlock();
+		return ptr;
+	}
+	if (lo && resizeLarge(lo, sz)) {
+		heapLock.unlock();
+		return lo->start;
+	}
+	heapLock.unlock();
+
+	/* The old object stays until the collector finds it unreachable */
+	buf = malloc(sz);
+	if (buf)
+		memcpy(buf, ptr, (old_sz < sz) ? old_sz : sz);
+	return buf;
+}
+
+template <class SourceHeap>
+void *GCMalloc<SourceHeap>::memalign(size_t alignment, size_t sz)
+{
+	void *ptr;
+
+	/* Every object is at least this aligned */
+	if (alignment <= Alignment)
+		return malloc(sz);
+	if (alignment & (alignment - 1))
+		return NULL;
+	if (sz > SIZE_MAX - alignment)
+		return NULL;
+	/* malloc(0) would get the smallest class, aligned to Alignment only */
+	if (sz == 0)
+		sz = 1;
+
+	/* Spans and large objects start on a page, so every slot of a small
+	 * class whose size is a multiple of the alignment is aligned */
+	if (alignment <= PageRun::PageSize)
+		return malloc((sz + alignment - 1) & ~(alignment - 1));
+
+	if (!initialized)
+		return NULL;
+	getThreadCache();
+	heapLock.lock();
+	maybeCollect(sz + alignment);
+	ptr = allocateLarge(sz, alignment);
 	heapLock.unlock();
-	return (void*)((char*)mem_chunk + HEADER_ALIGNED_SIZE);
+	return ptr;
 }
 
 template <class SourceHeap>
 size_t GCMalloc<SourceHeap>::getSize(void *p)
 {
-	Header *header;
-	header = (Header*)((char*)p - HEADER_ALIGNED_SIZE);
-	return header->getAllocatedSize();
+	PageRun *run;
+
+	run = findRun(p);
+	if (!run)
+		return 0;
+	if (run->kind == PageRun::SmallRun)
+		return ((Span*)run)->objectSize;
+	return ((LargeObject*)run)->objectSize;
 }
 
 template <class SourceHeap>
-size_t GCMalloc<SourceHeap>::bytesAllocated()
+int GCMalloc<SourceHeap>::createThread(pthread_t *thread, const pthread_attr_t *attr,
+				       void *(*start)(void *), void *arg)
 {
-	/* No need of locks, this is read only */
-	return allocated;
+	ThreadStart *ts;
+	int err;
+
+	if (!initialized)
+		return OSSpecific::createThread(thread, attr, start, arg);
+
+	heapLock.lock();
+	ts = startMeta.malloc();
+	if (!ts) {
+		heapLock.unlock();
+		return EAGAIN;
+	}
+	ts->start = start;
+	ts->arg = arg;
+	ts->heap = this;
+	ts->prevStart = NULL;
+	ts->nextStart = threadStarts;
+	if (threadStarts)
+		threadStarts->prevStart = ts;
+	threadStarts = ts;
+	heapLock.unlock();
+
+	err = OSSpecific::createThread(thread, attr, threadMain, ts);
+	if (err) {
+		heapLock.lock();
+		releaseThreadStart(ts);
+		heapLock.unlock();
+	}
+	return err;
+}
+
+template <class SourceHeap>
+void *GCMalloc<SourceHeap>::threadMain(void *p)
+{
+	ThreadStart *ts = (ThreadStart*)p;
+	GCMalloc *heap = ts->heap;
+	void *(*start)(void *) = ts->start;
+	void *arg = ts->arg;
+
+	/* Once registered, this thread's stack keeps arg reachable */
+	heap->getThreadCache();
+	heap->heapLock.lock();
+	heap->releaseThreadStart(ts);
+	heap->heapLock.unlock();
+	return start(arg);
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::releaseThreadStart(ThreadStart *ts)
+{
+	if (ts->prevStart)
+		ts->prevStart->nextStart = ts->nextStart;
+	else
+		threadStarts = ts->nextStart;
+	if (ts->nextStart)
+		ts->nextStart->prevStart = ts->prevStart;
+	startMeta.free(ts);
 }
 
 template <class SourceHeap>
-void GCMalloc<SourceHeap>::walk(const std::function< void(Header *) >& f)
+void GCMalloc<SourceHeap>::addLoaderObject(void *ptr)
 {
-	Header *tmp;
-	tmp = allocatedObjects;
-	while (tmp) {
-		f(tmp);
-		/* @allocatedObjects follows the tail, so we go backwards */
-		tmp = tmp->prevObject;
+	void *p;
+
+	heapLock.lock();
+	if (!loaderObjects) {
+		p = mmap(NULL, MaxLoaderObjects * sizeof(void*), PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+		if (p != MAP_FAILED)
+			loaderObjects = (void**)p;
 	}
+	/* Past the limit the object is only as safe as any other */
+	if (loaderObjects && loaderObjectCount < MaxLoaderObjects)
+		loaderObjects[loaderObjectCount++] = ptr;
+	heapLock.unlock();
 }
 
 template <class SourceHeap>
-size_t GCMalloc<SourceHeap>::getSizeFromClass(int index)
+void GCMalloc<SourceHeap>::removeLoaderObject(void *ptr)
 {
-	size_t class_sz;
-	if (index <= CLASS_16KB)
-		return (size_t)(index * 16);
-	class_sz = (size_t) pow(2, index - CLASS_16KB + LOG_LIMIT_16KB);
-	/* check for overflow */
-	if (!class_sz) {
-		perror("Out of memory!");
-		return 0;
+	size_t i;
+
+	heapLock.lock();
+	/* The last entry takes the freed one's place */
+	for (i = loaderObjectCount; i-- > 0; ) {
+		if (loaderObjects[i] == ptr) {
+			loaderObjects[i] = loaderObjects[--loaderObjectCount];
+			break;
+		}
 	}
-	return class_sz;
+	heapLock.unlock();
 }
 
 template <class SourceHeap>
-int constexpr GCMalloc<SourceHeap>::getSizeClass(size_t sz)
+bool GCMalloc<SourceHeap>::addRoots(void *start, void *end)
 {
-	/* The size of sizeClass excludes the header size */
-	/* 
-	* problem says: Your size classes should be exact multiples of 16
-	* for every size up to 16384, and then powers of two from 16,384 to 512 MB
-	* Class0 is kept unused for easy calculations.
-	* Class1 to Class1039 is valid.
-	*/
-	/* Upto LIMIT_16KB, there are CLASS_16KB classes */
+	bool ok;
 
-	/*
-	if (sz == 0)
-		return 1
-	if (sz > LIMIT_512MB)
-		return -1;
-	if (sz <= LIMIT_16KB)
-		return (int) ceil(sz / 16.0);
-	return (int) ceil(log2(sz)) - LOG_LIMIT_16KB + CLASS_16KB;
-	*/
+	heapLock.lock();
+	ok = sp.addRoots(start, end);
+	heapLock.unlock();
+	return ok;
+}
+
+template <class SourceHeap>
+bool GCMalloc<SourceHeap>::removeRoots(void *start, void *end)
+{
+	bool ok;
+
+	/* Waits out a collection that may be scanning the range */
+	heapLock.lock();
+	ok = sp.removeRoots(start, end);
+	heapLock.unlock();
+	return ok;
+}
+
+template <class SourceHeap>
+bool GCMalloc<SourceHeap>::excludeRoots(void *start, void *end)
+{
+	bool ok;
+
+	heapLock.lock();
+	ok = sp.excludeRoots(start, end);
+	heapLock.unlock();
+	return ok;
+}
+
+template <class SourceHeap>
+typename GCMalloc<SourceHeap>::Fiber *GCMalloc<SourceHeap>::registerFiber(void *stack, size_t size)
+{
+	PageRun *run;
+	Fiber *f;
+	char *block;
+
+	heapLock.lock();
+	f = fiberMeta.malloc();
+	if (!f) {
+		heapLock.unlock();
+		return NULL;
+	}
+	f->stack = (char*)stack;
+	f->stackEnd = (char*)stack + size;
+	f->object = NULL;
+	f->suspended = false;
+	/* A large object holding the stack is scanned through the fiber
+	 * alone, not in full when reached */
+	block = (char*)findObject(stack, &run);
+	if (block && run->kind != PageRun::SmallRun &&
+	    f->stackEnd <= block + ((LargeObject*)run)->objectSize) {
+		f->object = (LargeObject*)run;
+		f->object->fiberStack = true;
+	}
+	f->prevFiber = NULL;
+	f->nextFiber = fibers;
+	if (fibers)
+		fibers->prevFiber = f;
+	fibers = f;
+	heapLock.unlock();
+	return f;
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::unregisterFiber(Fiber *f)
+{
+	heapLock.lock();
+	if (f->object)
+		f->object->fiberStack = false;
+	if (f->prevFiber)
+		f->prevFiber->nextFiber = f->nextFiber;
+	else
+		fibers = f->nextFiber;
+	if (f->nextFiber)
+		f->nextFiber->prevFiber = f->prevFiber;
+	fiberMeta.free(f);
+	heapLock.unlock();
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::suspendFiber(Fiber *f, void *sp, void *regs, size_t len)
+{
+	char *p = sp ? (char*)sp : (char*)__builtin_frame_address(0);
+
+	/* No lock: only a stopped world reads these, and it finds the fiber
+	 * running (scanned whole) until suspended is set */
+	f->stackPointer = (p >= f->stack && p < f->stackEnd) ? p : f->stack;
+	f->registersStart = (char*)regs;
+	f->registersEnd = (char*)regs + len;
+	__atomic_store_n(&f->suspended, true, __ATOMIC_RELEASE);
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::resumeFiber(Fiber *f)
+{
+	__atomic_store_n(&f->suspended, false, __ATOMIC_RELEASE);
+}
+
+template <class SourceHeap>
+size_t GCMalloc<SourceHeap>::bytesAllocated()
+{
+	/* No need of locks, this is read only */
+	return allocated;
+}
+
+template <class SourceHeap>
+size_t GCMalloc<SourceHeap>::trim()
+{
+	size_t purged;
+
+	getThreadCache();
+	heapLock.lock();
+	gc();
+	finishSweep();
+	purged = pageHeap.purge(0);
+	heapLock.unlock();
+	return purged;
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::printStats()
+{
+	static const char *modes[] = { "small", "thp", "hugetlb" };
 
-	return (sz == 0) ?
-		1 :
-		(sz > LIMIT_512MB) ?
-			-1 :
-			(sz <= LIMIT_16KB) ?
-				((int) ceil(sz / 16.0)) :
-					((int) ceil(log2(sz)) - LOG_LIMIT_16KB + CLASS_16KB);
+	heapLock.lock();
+	tprintf("gcmalloc: pages @, bytes in use now @, objects allocated to date @\n",
+		modes[SourceHeap::getPageMode()], allocated, objectsAllocated);
+	tprintf("gcmalloc: @ collections, mark @ us, sweep @ us, paused @ us (longest @ us, remark @ us)\n",
+		collections, (unsigned long)(markTime / 1000), (unsigned long)(sweepTime / 1000),
+		(unsigned long)(pauseTime / 1000), (unsigned long)(maxPause / 1000),
+		(unsigned long)(maxRemark / 1000));
+	heapLock.unlock();
 }
 
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::walk(const std::function< void(void *) >& f)
+{
+	PageRun *run, *next;
+	Span *span;
+
+	/* Unswept spans still count the unreachable objects as allocated */
+	heapLock.lock();
+	finishSweep();
+	heapLock.unlock();
+
+	for (run = allSpans; run; run = run->next) {
+		span = (Span*)run;
+		for (unsigned i = 0; i < span->freshIndex; i++) {
+			if (span->isAllocated(i))
+				f(span->objectAddress(i));
+		}
+	}
+
+	for (run = largeObjects; run; run = next) {
+		/* @f may free the object and unlink it, so step first */
+		next = run->next;
+		f(run->start);
+	}
+}
 
 /* private: */
 
 template <class SourceHeap>
-void GCMalloc<SourceHeap>::scan(void *start, void *end)
+void GCMalloc<SourceHeap>::scan(Marker *m, void *start, void *end)
 {
-	char *tmp, *p = (char*)start;
+	void **p;
 	/* Go through every potential pointer */
-	for (;p < end; p += PTR_SIZE) {
-		uintptr_t addr = *p;
-		if (addr < (uintptr_t)startHeap || addr > (uintptr_t)endHeap)
+	for (p = (void**)start; (void*)(p + 1) <= end; p++) {
+		uintptr_t addr = (uintptr_t)*p;
+		if (!inHeap((void*)addr))
 			continue;
 		/* Ignore if it's a pointer to the same block, block is already marked */
-		if (addr >= (uintptr_t)start && addr <= (uintptr_t)end)
+		if (addr >= (uintptr_t)start && addr < (uintptr_t)end)
 			continue;
-
-		tmp = p;
-		/* move to the aligned address right before tmp in case tmp is not aligned */
-		if(!is_aligned(tmp))
-			tmp = tmp + calc_align_offset(tmp) - Alignment;
-
-		/* backtrace until the beginning of the block, and recursively mark */
-		while (1) {
-			if (isPointer((void*)tmp))
-				break;
-			tmp -= Alignment;
-		}
-		markReachable((void*)tmp);
+		markPointer(m, *p);
 	}
 }
 
-/* TODO more conditions, ,
-then you must trigger a collection. */
 template <class SourceHeap>
-bool GCMalloc<SourceHeap>::triggerGC(size_t szRequested)
+bool GCMalloc<SourceHeap>::memoryShort(size_t szRequested)
 {
 	int class_index;
 	size_t heapRemaining;
@@ -237,17 +640,39 @@ bool GCMalloc<SourceHeap>::triggerGC(size_t szRequested)
 		return false;
 
 	class_index = getSizeClass(szRequested);
-	heapRemaining = SourceHeap::getRemaining();
+	heapRemaining = pageHeap.getRemaining();
 
 	if (class_index < 0)
 		return false;
 
 	/* Do gc if freelist is empty and no memory available */
-	if (!freedObjects[class_index] && heapRemaining < szRequested)
+	if (class_index <= CLASS_16KB) {
+		if (!partialSpans[class_index] && pageHeap.getFreePages() < Span::SpanPages &&
+				heapRemaining < Span::SpanSize)
+			return true;
+	} else if (szRequested <= HugeThreshold && pageHeap.getFreePages() < PAGES(szRequested) &&
+			heapRemaining < szRequested) {
+		return true;
+	} else if (szRequested > HugeThreshold &&
+			SourceHeap::getRemaining() < getGoodSize(szRequested)) {
+		/* Huge objects are mapped apart, so free pages cannot serve them */
+		return true;
+	}
+
+	/* Do gc when not much of heap remains free. 4*GC_THRESHOLD holds no special significance */
+	if (heapRemaining < 4 * GC_THRESHOLD)
 		return true;
 
-	/* Do gc when not much of heap remains free. 4*nextGC holds no special significance */
-	if (heapRemaining < 4 * nextGC)
+	return false;
+}
+
+template <class SourceHeap>
+bool GCMalloc<SourceHeap>::triggerGC(size_t szRequested)
+{
+	if (!szRequested || getSizeClass(szRequested) < 0)
+		return false;
+
+	if (memoryShort(szRequested))
 		return true;
 
 	/* Do gc when a lot of mem allocated since last gc */
@@ -255,126 +680,1453 @@ bool GCMalloc<SourceHeap>::triggerGC(size_t szRequested)
 }
 
 template <class SourceHeap>
-void GCMalloc<SourceHeap>::gc()
+void GCMalloc<SourceHeap>::maybeCollect(size_t szRequested)
 {
-	heapLock.lock();
+	if (inGC || !canCollect())
+		return;
+	if (incrementalMarking) {
+		/* Memory is short: the rest of the work is owed now */
+		if (szRequested && getSizeClass(szRequested) >= 0 && memoryShort(szRequested))
+			gc();
+		else
+			markSlice();
+		return;
+	}
+	/* Sweeping may free what is needed, without collecting again */
+	if (sweepPending && memoryShort(szRequested))
+		finishSweep();
+	if (!triggerGC(szRequested))
+		return;
+	if (markBudget && !memoryShort(szRequested) && startIncrementalMark())
+		return;
+	gc();
+}
+
+template <class SourceHeap>
+bool GCMalloc<SourceHeap>::startIncrementalMark()
+{
+	/* Soft-dirty bits are the write barrier: without them, collect at once */
+	if (!sp.clearSoftDirty())
+		return false;
+	/* The slices will set marks that the last sweep has yet to read */
+	finishSweep();
+	/* Finding the roots may allocate; that must not start a slice */
 	inGC = true;
-	mark();
-	sweep();
-	bytesAllocatedSinceLastGC = 0;
+	incrementalMarking = true;
+	markingConcurrently = true;
+	sliceAllocated = bytesAllocatedSinceLastGC;
+	pushRoots();
 	inGC = false;
-	heapLock.unlock();
+	markSlice();
+	return true;
 }
 
 template <class SourceHeap>
-void GCMalloc<SourceHeap>::mark()
+void GCMalloc<SourceHeap>::markSlice()
 {
-	auto fn_marker = [&](void *ptr){
-		uintptr_t heap_iptr;
-		char *tmp;
-		Header *hd;
-
-		heap_iptr = (uintptr_t)ptr;
-
-		if (heap_iptr < (uintptr_t)startHeap + HEADER_ALIGNED_SIZE || heap_iptr > (uintptr_t)endHeap)
-			return;
+	Marker *m = &markers[0];
+	MarkStack::Entry e;
+	uint64_t start, deadline, elapsed;
+	size_t work, scanned = 0;
+	unsigned n = 0;
 
-		tmp = (char*)ptr;
-		/* move to the aligned address right before tmp in case tmp is not aligned */
-		if(!is_aligned(tmp))
-			tmp = tmp + calc_align_offset(tmp) - Alignment;
+	inGC = true;
+	start = nanoTime();
+	deadline = start + markBudget;
+	/* Pay for what was allocated since the last slice */
+	work = (bytesAllocatedSinceLastGC - sliceAllocated) * MarkWorkRatio;
+	if (work < MarkChunkBytes)
+		work = MarkChunkBytes;
+	sliceAllocated = bytesAllocatedSinceLastGC;
 
-		/* backtrace until the beginning of the block, and recursively mark */
-		while (1) {	
-			if (isPointer((void*)tmp))
+	while (scanned < work) {
+		if (!popMark(m, e)) {
+			flushPrefetchQueue(m);
+			if (!popMark(m, e))
 				break;
-			tmp -= Alignment;
 		}
-		markReachable((void*)tmp);
-	};
+		scanned += min((size_t)(e.end - e.start), (size_t)MarkChunkBytes);
+		scanEntry(m, e);
+		/* Reading the clock costs more than scanning a small object */
+		if (++n % 64 == 0 && nanoTime() > deadline)
+			break;
+	}
+
+	elapsed = nanoTime() - start;
+	markTime += elapsed;
+	pauseTime += elapsed;
+	if (elapsed > maxPause)
+		maxPause = elapsed;
+	inGC = false;
 
-	sp.walkStack(fn_marker);
-	sp.walkGlobals(fn_marker);
+	/* Out of work: finish with the remark and the sweep */
+	if (!m->pending && !m->prefetchCount)
+		gc();
 }
 
 template <class SourceHeap>
-void GCMalloc<SourceHeap>::markReachable(void *block)
+void GCMalloc<SourceHeap>::gc()
 {
-	void *block_end;
-	Header *hd;
-	hd = (Header*)((char*)block - HEADER_ALIGNED_SIZE);
-	block_end = (void*)((char*)block + hd->getAllocatedSize());
-	hd->mark();
-	scan(block, block_end);
+	uint64_t start, paused, marked;
+	bool remarked;
+
+	/* Another thread may get here while a concurrent mark has the lock released */
+	if (inGC || !canCollect())
+		return;
+	inGC = true;
+	if (!markersStarted)
+		startMarkers();
+	start = paused = nanoTime();
+	/* Marking sets the marks the sweep still reads */
+	finishSweep();
+	/* Cached objects of the collecting thread go back to their spans */
+	if (threadCache)
+		flushCache(threadCache);
+	remarked = incrementalMarking;
+	if (incrementalMarking) {
+		/* The slices did most of the marking */
+		incrementalMarking = false;
+		markingConcurrently = false;
+		stopWorld();
+		remark();
+	} else if (concurrentMarking && sp.clearSoftDirty()) {
+		/* Mark while the mutators run; what they write meanwhile shows
+		 * up in the soft-dirty bits, and remark() scans it again */
+		markingConcurrently = true;
+		heapLock.unlock();
+		mark();
+		heapLock.lock();
+		markingConcurrently = false;
+		paused = nanoTime();
+		stopWorld();
+		remark();
+	} else {
+		/* Only now is it worth clearing the soft-dirty bits just to
+		 * find the global pages written by the next collection */
+		trackGlobals = sp.globalSize() >= GlobalTrackingMin &&
+			sp.globalSize() * GlobalTrackingRatio >= allocated;
+		stopWorld();
+		mark();
+		if (trackGlobals)
+			sp.trackGlobalWrites();
+		trackGlobals = false;
+	}
+	markCachedObjects();
+	startWorld();
+	/* No marker searches the huge object table now */
+	hugeObjects.releaseRetired();
+	marked = nanoTime();
+	/* Flip first: what is allocated from here on, even by a lazy sweep's
+	 * own thread start, must count as marked for the sweep */
+	sweepEpoch = markEpoch;
+	markEpoch = !markEpoch;
+	if (lazySweeping)
+		queueSweep();
+	else
+		sweep();
+	collections++;
+	markTime += marked - start;
+	sweepTime += nanoTime() - marked;
+	bytesAllocatedSinceLastGC = 0;
+	/* Now that the heap can grow, let it double before the next gc so the
+	 * cost of collecting stays proportional to what was allocated (a lazy
+	 * sweep sets it again once it knows) */
+	nextGC = (allocated > GC_THRESHOLD) ? allocated : GC_THRESHOLD;
+	/* Pages that stayed free since well before this gc are not coming back soon */
+	pageHeap.purge(PurgeDecay);
+	paused = nanoTime() - paused;
+	pauseTime += paused;
+	if (remarked && paused > maxRemark)
+		maxRemark = paused;
+	else if (!remarked && paused > maxPause)
+		maxPause = paused;
+	inGC = false;
 }
 
 template <class SourceHeap>
-void GCMalloc<SourceHeap>::sweep()
+void GCMalloc<SourceHeap>::mark()
 {
-	bytesReclaimedLastGC = 0;
-	walk([&](Header *h){
-		if (h->isMarked()) {
-			/* This is a reachable obj, so clear() as an init condition for next gc */
-			h->clear();
-			return;
-		}
-		privateFree((char*)h + HEADER_ALIGNED_SIZE);
-	});
+	pushRoots();
+	drainMarkStack();
 }
 
 template <class SourceHeap>
-void GCMalloc<SourceHeap>::privateFree(void * ptr)
+void GCMalloc<SourceHeap>::pushRoots()
 {
-	Header *header, *freelist;
-	int class_index;
-
-	if (!ptr || !isPointer(ptr))
-		return;
+	Marker *m = &markers[0];
+	ThreadCache *self = threadCache;
+	char *here = (char*)__builtin_frame_address(0);
 
-	/* If address in unaligned, die gracefully and immediately */
-	if (!is_aligned(ptr))
-		return;
-
-	heapLock.lock();
-	header = (Header*)((char*)ptr - HEADER_ALIGNED_SIZE);
+	/* Roots go on the collecting thread's mark stack as ranges, for any
+	 * marker to split and steal */
+	auto push_roots = [&](void *start, void *end){
+		if (!pushMark(m, (char*)start, (char*)end))
+			scan(m, start, end);
+	};
 
-	/* Disconnect from SourceHeap's doubly linked list tailed by @allocatedObjects */
-	if (header == allocatedObjects)
-		allocatedObjects = header->prevObject;
+	/* This thread's registers, spilled where the markers can see them,
+	 * and the live part of its stack, from here to the top recorded at
+	 * registration (frames below this one change while the roots are
+	 * scanned). Running on a fiber's stack, all of the thread's own.
+	 * An incremental mark leaves them, like every stack, to the final
+	 * remark: the thread returns to its frames long before the slices
+	 * would get to them */
+	if (!incrementalMarking || worldStopped) {
+		OSSpecific::getRegisters(self->registers);
+		push_roots(&self->registers, &self->registers + 1);
+		if (here >= self->stackBottom && here < self->stackTop)
+			push_roots(here, self->stackTop);
+		else
+			push_roots(self->stackBottom, self->stackTop);
+		if (self->tlsStart)
+			push_roots(self->tlsStart, self->tlsEnd);
+	}
+	if (worldStopped) {
+		/* The stacks and registers of the stopped threads, one range
+		 * each, so that markers scan them in parallel */
+		for (ThreadCache *tc = allCaches; tc; tc = tc->nextCache) {
+			if (!tc->stopped)
+				continue;
+			if (tc->stackTop)
+				push_roots(tc->stackPointer, tc->stackTop);
+			if (tc->tlsStart)
+				push_roots(tc->tlsStart, tc->tlsEnd);
+			push_roots(&tc->registers, &tc->registers + 1);
+		}
+		/* The arguments of threads still starting up */
+		for (ThreadStart *ts = threadStarts; ts; ts = ts->nextStart)
+			push_roots(&ts->arg, &ts->arg + 1);
+		/* The registered fibers' stacks (and their objects): only the
+		 * live part and the saved registers of a suspended one, all of
+		 * a running one, whose frames change under the markers */
+		for (Fiber *f = fibers; f; f = f->nextFiber) {
+			push_roots(&f->stack, &f->stack + 1);
+			if (!f->suspended) {
+				push_roots(f->stack, f->stackEnd);
+				continue;
+			}
+			push_roots(f->stackPointer, f->stackEnd);
+			if (f->registersStart < f->registersEnd)
+				push_roots(f->registersStart, f->registersEnd);
+		}
+	}
+	/* The objects the loader allocated (the array never moves) */
+	if (loaderObjectCount)
+		push_roots(loaderObjects, loaderObjects + loaderObjectCount);
+	/* The globals of every loaded object but the excluded parts (this
+	 * heap's own state among them), and the roots the program added.
+	 * Those of objects loaded later and the added roots wait for a
+	 * stopped world, so that a dlclose or a removal cannot unmap them
+	 * under the markers. Pages found to hold nothing that points into the
+	 * heap are skipped until written (see trackGlobals) */
+	sp.walkGlobalPages(push_roots, [this](void *start, void *end){
+		for (void **p = (void**)start; p < (void**)end; p++)
+			if (inHeap(*p))
+				return true;
+		return false;
+	}, worldStopped, trackGlobals);
+}
 
-	if (header->prevObject) {
-		header->prevObject->nextObject = header->nextObject;
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::remark()
+{
+	Marker *m = &markers[0];
+	PageRun *run;
+	Span *span;
+	LargeObject *lo;
+	char *page, *obj, *lo_end, *range_start = NULL, *range_end = NULL;
+	unsigned first, last;
+	uint64_t bits;
+	size_t n;
+
+	/* Push [start, end), merged with the range before it when adjacent */
+	auto push_dirty = [&](char *start, char *end){
+		if (start == range_end) {
+			range_end = end;
+			return;
+		}
+		if (range_start && !pushMark(m, range_start, range_end))
+			scan(m, range_start, range_end);
+		range_start = start;
+		range_end = end;
+	};
+
+	pageHeap.loadDirtyPages([&](char *start, size_t pages, uint64_t *dirty){
+		return sp.readSoftDirty(start, pages, dirty);
+	});
+
+	/* The parts of marked small objects on written pages */
+	for (run = allSpans; run; run = run->next) {
+		span = (Span*)run;
+		for (page = span->start; page < span->end(); page += PageRun::PageSize) {
+			if (!span->inObjectArea(page) || !pageHeap.isDirty(page))
+				continue;
+			first = span->objectIndex(page);
+			last = span->objectIndex(page + PageRun::PageSize - 1);
+			if (last >= span->objectCount)
+				last = span->objectCount - 1;
+			for (unsigned i = first; i <= last; i++) {
+				obj = span->objectAddress(i);
+				if (!span->isAllocated(i) || !isMarked(span, obj))
+					continue;
+				push_dirty(max(obj, page), min(obj + span->objectSize, page + PageRun::PageSize));
+			}
+		}
 	}
 
-	if (header->nextObject) {
-		header->nextObject->prevObject = header->prevObject;
+	/* The written pages of marked large and huge objects */
+	for (run = largeObjects; run; run = run->next) {
+		lo = (LargeObject*)run;
+		if (lo->marked != markEpoch || lo->fiberStack)
+			continue;
+		lo_end = lo->start + lo->objectSize;
+		for (page = lo->start; page < lo_end; page += 64 * PageRun::PageSize) {
+			n = min((size_t)64, (size_t)(lo_end - page + PageRun::PageSize - 1) >> PageRun::PageShift);
+			if (lo->kind == PageRun::LargeRun) {
+				bits = 0;
+				for (size_t i = 0; i < n; i++)
+					bits |= (uint64_t)pageHeap.isDirty(page + (i << PageRun::PageShift)) << i;
+			} else if (!sp.readSoftDirty(page, n, &bits)) {
+				bits = ~0UL;
+			}
+			for (size_t i = 0; i < n; i++)
+				if ((bits >> i) & 1)
+					push_dirty(page + (i << PageRun::PageShift),
+						   min(page + ((i + 1) << PageRun::PageShift), lo_end));
+		}
 	}
+	push_dirty(NULL, NULL);
 
-	/* Connect to its free list chain */
-	class_index = getSizeClass(header->getAllocatedSize());
-	if (class_index < 0) {
-		perror("Memory error.");
-		heapLock.unlock();
+	/* Then the roots again, and everything newly reachable */
+	mark();
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::markPointer(Marker *m, void *ptr)
+{
+	void *oldest;
+
+	if (!inHeap(ptr))
+		return;
+	pageHeap.prefetch(ptr);
+	if (m->prefetchCount < PrefetchDepth) {
+		m->prefetchQueue[(m->prefetchHead + m->prefetchCount++) % PrefetchDepth] = ptr;
+		return;
+	}
+	/* Full: the oldest candidate's metadata has had the longest to arrive */
+	oldest = m->prefetchQueue[m->prefetchHead];
+	m->prefetchQueue[m->prefetchHead] = ptr;
+	m->prefetchHead = (m->prefetchHead + 1) % PrefetchDepth;
+	markObject(m, oldest);
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::flushPrefetchQueue(Marker *m)
+{
+	void *ptr;
+
+	while (m->prefetchCount) {
+		ptr = m->prefetchQueue[m->prefetchHead];
+		m->prefetchHead = (m->prefetchHead + 1) % PrefetchDepth;
+		m->prefetchCount--;
+		markObject(m, ptr);
+	}
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::markObject(Marker *m, void *ptr)
+{
+	void *block, *block_end;
+	PageRun *run;
+	LargeObject *lo;
+
+	block = findObject(ptr, &run);
+	if (!block)
 		return;
+	/* Markers race for objects: only the one that sets the mark pushes it */
+	if (run->kind == PageRun::SmallRun) {
+		if (!pageHeap.trySetMark(block, markEpoch))
+			return;
+		block_end = (char*)block + ((Span*)run)->objectSize;
+	} else {
+		lo = (LargeObject*)run;
+		if (__atomic_exchange_n(&lo->marked, markEpoch, __ATOMIC_RELAXED) == markEpoch)
+			return;
+		/* pushRoots() scans what is live of a fiber's stack */
+		if (lo->fiberStack)
+			return;
+		block_end = (char*)block + lo->objectSize;
+	}
+	/* Likely the next object scanned */
+	__builtin_prefetch(block);
+	/* Marked but unscanned: rescanMarked() will find its children */
+	if (!pushMark(m, (char*)block, (char*)block_end))
+		markStackOverflowed = true;
+}
+
+template <class SourceHeap>
+bool GCMalloc<SourceHeap>::pushMark(Marker *m, char *start, char *end)
+{
+	bool pushed;
+
+	m->lock.lock();
+	pushed = m->stack.push(start, end);
+	m->pending = m->stack.size();
+	m->lock.unlock();
+	return pushed;
+}
+
+template <class SourceHeap>
+bool GCMalloc<SourceHeap>::popMark(Marker *m, MarkStack::Entry &e)
+{
+	bool popped;
+
+	m->lock.lock();
+	popped = m->stack.pop(e);
+	m->pending = m->stack.size();
+	m->lock.unlock();
+	return popped;
+}
+
+template <class SourceHeap>
+bool GCMalloc<SourceHeap>::stealMarks(Marker *m)
+{
+	MarkStack::Entry stolen[StealBatch];
+	Marker *victim;
+	size_t n, got;
+
+	for (unsigned k = 1; k < markerCount; k++) {
+		victim = &markers[(m->id + k) % markerCount];
+		if (!victim->pending)
+			continue;
+		/* Half of its work, oldest (likely the biggest subgraphs) first */
+		victim->lock.lock();
+		n = (victim->stack.size() + 1) / 2;
+		if (n > StealBatch)
+			n = StealBatch;
+		for (got = 0; got < n && victim->stack.steal(stolen[got]); got++)
+			;
+		victim->pending = victim->stack.size();
+		victim->lock.unlock();
+		if (!got)
+			continue;
+		for (size_t i = 0; i < got; i++)
+			if (!pushMark(m, stolen[i].start, stolen[i].end))
+				scan(m, stolen[i].start, stolen[i].end);
+		return true;
+	}
+	return false;
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::scanEntry(Marker *m, MarkStack::Entry &e)
+{
+	/* Scan big ranges a chunk at a time, leaving the rest to be stolen */
+	if (e.end - e.start > MarkChunkBytes && pushMark(m, e.start + MarkChunkBytes, e.end))
+		e.end = e.start + MarkChunkBytes;
+	scan(m, e.start, e.end);
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::markLoop(Marker *m)
+{
+	MarkStack::Entry e;
+	unsigned k;
+
+	for (;;) {
+		if (popMark(m, e)) {
+			scanEntry(m, e);
+			continue;
+		}
+		if (m->prefetchCount) {
+			flushPrefetchQueue(m);
+			continue;
+		}
+		if (stealMarks(m))
+			continue;
+		/* Out of work. Only busy markers make more, so once every marker
+		 * is idle, marking is over */
+		idleMarkers++;
+		for (;;) {
+			if (idleMarkers == markerCount)
+				return;
+			for (k = 0; k < markerCount && !markers[k].pending; k++)
+				;
+			if (k < markerCount) {
+				idleMarkers--;
+				break;
+			}
+			sched_yield();
+		}
+	}
+}
+
+template <class SourceHeap>
+void *GCMalloc<SourceHeap>::markerMain(void *arg)
+{
+	Marker *m = (Marker*)arg;
+	GCMalloc *heap = m->heap;
+	unsigned long seen = 0;
+
+	for (;;) {
+		{
+			unique_lock<mutex> guard(heap->markerLock);
+			heap->markerWake.wait(guard, [&]{ return heap->markRound != seen; });
+			seen = heap->markRound;
+		}
+		heap->markLoop(m);
+		{
+			lock_guard<mutex> guard(heap->markerLock);
+			if (--heap->markersBusy == 0)
+				heap->markerDone.notify_one();
+		}
+	}
+	return NULL;
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::startMarkers()
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	unsigned n;
+
+	/* The pool threads never use dynamic TLS and never exit, so anything
+	 * pthread_create allocates for them from this heap can be collected */
+	markersStarted = true;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	/* Not through createThread: the pool must never be stopped */
+	for (n = 1; n < markerCount; n++)
+		if (OSSpecific::createThread(&thread, &attr, markerMain, &markers[n]))
+			break;
+	pthread_attr_destroy(&attr);
+	markerCount = n;
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::runMarkers()
+{
+	unique_lock<mutex> guard(markerLock);
+
+	idleMarkers = 0;
+	markersBusy = markerCount - 1;
+	markRound++;
+	markerWake.notify_all();
+	guard.unlock();
+
+	markLoop(&markers[0]);
+
+	guard.lock();
+	markerDone.wait(guard, [&]{ return markersBusy == 0; });
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::drainMarkStack()
+{
+	for (;;) {
+		runMarkers();
+		if (!markStackOverflowed)
+			break;
+		markStackOverflowed = false;
+		rescanMarked();
+	}
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::rescanMarked()
+{
+	Marker *m = &markers[0];
+	MarkStack::Entry e;
+	PageRun *run;
+	Span *span;
+	LargeObject *lo;
+	char *obj;
+
+	/* On the collecting thread alone: overflow is rare */
+	for (run = allSpans; run; run = run->next) {
+		span = (Span*)run;
+		for (unsigned i = 0; i < span->objectCount; i++) {
+			obj = span->objectAddress(i);
+			if (span->isAllocated(i) && isMarked(span, obj))
+				scan(m, obj, obj + span->objectSize);
+		}
+		/* Keep the stack short while rescanning */
+		while (popMark(m, e))
+			scan(m, e.start, e.end);
+	}
+	for (run = largeObjects; run; run = run->next) {
+		lo = (LargeObject*)run;
+		if (lo->marked == markEpoch && !lo->fiberStack)
+			scan(m, lo->start, lo->start + lo->objectSize);
+		while (popMark(m, e))
+			scan(m, e.start, e.end);
 	}
-	freelist = freedObjects[class_index];
-	freedObjects[class_index] = header;
-	header->prevObject = NULL;
-	header->nextObject = freelist;
-	if (freelist)
-		freelist->prevObject = header;
+}
+
+template <class SourceHeap>
+bool GCMalloc<SourceHeap>::isMarked(PageRun *run, void *block)
+{
+	if (run->kind == PageRun::SmallRun)
+		return pageHeap.getMark(block) == markEpoch;
+	return ((LargeObject*)run)->marked == markEpoch;
+}
+
+template <class SourceHeap>
+PageRun *GCMalloc<SourceHeap>::findRun(void *p)
+{
+	if (pageHeap.contains(p))
+		return pageHeap.find(p);
+	if (p >= hugeLow && p < hugeHigh)
+		return hugeObjects.find(p);
+	return NULL;
+}
+
+template <class SourceHeap>
+void *GCMalloc<SourceHeap>::findObject(void *p, PageRun **owner)
+{
+	PageRun *run;
+	Span *span;
+	LargeObject *lo;
+	unsigned index;
+
+	run = findRun(p);
+	if (!run)
+		return NULL;
+	if (owner)
+		*owner = run;
+
+	switch (run->kind) {
+	case PageRun::SmallRun:
+		/* The page map gives the span, arithmetic gives the object */
+		span = (Span*)run;
+		if (!span->inObjectArea(p))
+			return NULL;
+		index = span->objectIndex(p);
+		return span->isAllocated(index) ? span->objectAddress(index) : NULL;
+	case PageRun::LargeRun:
+	case PageRun::HugeRun:
+		lo = (LargeObject*)run;
+		return ((char*)p < lo->start + lo->objectSize) ? lo->start : NULL;
+	default:
+		return NULL;
+	}
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::sweep()
+{
+	PageRun *run, *next;
+	LargeObject *lo;
+	Span *span;
 
-	allocated -= header->getAllocatedSize();
-	bytesReclaimedLastGC +=  header->getAllocatedSize();
+	bytesReclaimedLastGC = 0;
+	for (run = allSpans; run; run = next) {
+		next = run->next;
+		span = (Span*)run;
+		sweepSpan(span);
+		/* Whole empty spans go back to the page heap for any size */
+		if (span->isEmpty())
+			releaseSpan(span);
+	}
+
+	for (run = largeObjects; run; run = next) {
+		next = run->next;
+		lo = (LargeObject*)run;
+		/* Reachable; the epoch flip unmarks it for the next gc */
+		if (lo->marked == sweepEpoch)
+			continue;
+		bytesReclaimedLastGC += lo->objectSize;
+		freeLarge(lo);
+	}
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::queueSweep()
+{
+	PageRun *run;
+	Span *span;
+
+	/* Only the span descriptors are touched here; their objects wait */
+	bytesReclaimedLastGC = 0;
+	for (run = allSpans; run; run = run->next) {
+		span = (Span*)run;
+		span->nextUnswept = unsweptSpans[span->sizeClass];
+		unsweptSpans[span->sizeClass] = span;
+		unsweptCount++;
+	}
+	unsweptLarge = largeObjects;
+	sweepPending = true;
+
+	if (!sweeperStarted) {
+		pthread_attr_t attr;
+		pthread_t thread;
+
+		/* Like the markers, never stopped: it sweeps with heapLock held */
+		sweeperStarted = true;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		OSSpecific::createThread(&thread, &attr, sweeperMain, this);
+		pthread_attr_destroy(&attr);
+	}
+	lock_guard<mutex> guard(sweepLock);
+	sweepRound++;
+	sweepWake.notify_one();
+}
+
+template <class SourceHeap>
+Span *GCMalloc<SourceHeap>::sweepClass(int class_index)
+{
+	Span *span;
+	uint64_t start;
+
+	start = nanoTime();
+	while (!partialSpans[class_index] && unsweptSpans[class_index]) {
+		span = unsweptSpans[class_index];
+		unsweptSpans[class_index] = span->nextUnswept;
+		unsweptCount--;
+		/* Empty or not, it is about to be used */
+		sweepSpan(span);
+	}
+	sweepTime += nanoTime() - start;
+	return partialSpans[class_index];
+}
+
+template <class SourceHeap>
+bool GCMalloc<SourceHeap>::sweepSome(size_t n)
+{
+	LargeObject *lo;
+	Span *span;
+	uint64_t start;
+	bool more;
+	size_t live;
+	int c = 0;
+
+	heapLock.lock();
+	start = nanoTime();
+	for (size_t i = 0; sweepPending && (i < n || !n); i++) {
+		if (unsweptCount) {
+			while (!unsweptSpans[c])
+				c++;
+			span = unsweptSpans[c];
+			unsweptSpans[c] = span->nextUnswept;
+			unsweptCount--;
+			sweepSpan(span);
+			if (span->isEmpty())
+				releaseSpan(span);
+		} else if (unsweptLarge) {
+			lo = (LargeObject*)unsweptLarge;
+			unsweptLarge = lo->next;
+			if (lo->marked != sweepEpoch) {
+				bytesReclaimedLastGC += lo->objectSize;
+				freeLarge(lo);
+			}
+		} else {
+			/* Done: now the live size is known */
+			sweepPending = false;
+			live = (allocated > (size_t)bytesAllocatedSinceLastGC) ?
+				allocated - bytesAllocatedSinceLastGC : 0;
+			nextGC = (live > GC_THRESHOLD) ? live : GC_THRESHOLD;
+		}
+	}
+	more = sweepPending;
+	sweepTime += nanoTime() - start;
 	heapLock.unlock();
+	return more;
+}
+
+template <class SourceHeap>
+void *GCMalloc<SourceHeap>::sweeperMain(void *arg)
+{
+	GCMalloc *heap = (GCMalloc*)arg;
+	unsigned long seen = 0;
+
+	for (;;) {
+		{
+			unique_lock<mutex> guard(heap->sweepLock);
+			heap->sweepWake.wait(guard, [&]{ return heap->sweepRound != seen; });
+			seen = heap->sweepRound;
+		}
+		/* A chunk at a time, so that allocating threads wait for heapLock
+		 * no longer than one chunk takes */
+		while (heap->sweepSome(SweepChunk))
+			sched_yield();
+	}
+	return NULL;
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::sweepSpan(Span *span)
+{
+	uint64_t live, dead;
+	unsigned index, n;
+	void *obj;
+	size_t freed = 0;
+
+	for (int w = 0; w < Span::BitmapWords; w++) {
+		if (!span->allocBits[w])
+			continue;
+		/* Allocated but not marked means unreachable. The mark bits are
+		 * left alone: the survivors' read as unmarked once the epoch flips */
+		n = span->objectCount - w * 64;
+		if (n > 64)
+			n = 64;
+		live = pageHeap.getMarks(span->objectAddress(w * 64), span->objectSize, n);
+		if (!sweepEpoch)
+			live = ~live;
+		dead = span->allocBits[w] & ~live;
+		span->allocBits[w] &= ~dead;
+		while (dead) {
+			index = w * 64 + __builtin_ctzl(dead);
+			dead &= dead - 1;
+			obj = span->objectAddress(index);
+			*(void**)obj = span->freeList;
+			span->freeList = obj;
+			freed++;
+		}
+	}
+	if (!freed)
+		return;
+	span->allocatedCount -= freed;
+	allocated -= freed * span->objectSize;
+	bytesReclaimedLastGC += freed * span->objectSize;
+	if (!span->inPartialList)
+		addPartial(span);
 }
 
 template <class SourceHeap>
 bool GCMalloc<SourceHeap>::isPointer(void * p)
 {
-	if (p < (char*)startHeap + HEADER_ALIGNED_SIZE || p > endHeap)
+	return p && findObject(p) == p;
+}
+
+template <class SourceHeap>
+void *GCMalloc<SourceHeap>::allocateSmall(int class_index)
+{
+	Span *span;
+	void *ptr;
+
+	span = partialSpans[class_index];
+	if (!span && sweepPending)
+		span = sweepClass(class_index);
+	if (!span) {
+		span = newSpan(class_index);
+		if (!span)
+			return NULL;
+	}
+
+	if (span->freeList) {
+		ptr = span->freeList;
+		span->freeList = *(void**)ptr;
+	} else {
+		ptr = span->objectAddress(span->freshIndex++);
+	}
+	span->setAllocated(span->objectIndex(ptr));
+	pageHeap.setMark(ptr, !markEpoch);
+	span->allocatedCount++;
+	if (span->isFull())
+		removePartial(span);
+
+	/* A little stats */
+	allocated += span->objectSize;
+	bytesAllocatedSinceLastGC += span->objectSize;
+	objectsAllocated += 1;
+	return ptr;
+}
+
+template <class SourceHeap>
+size_t GCMalloc<SourceHeap>::allocateBatch(int class_index, size_t count, void **out)
+{
+	Span *span;
+	char *obj;
+	size_t got = 0, size;
+	unsigned n, first;
+
+	size = getSizeFromClass(class_index);
+	while (got < count) {
+		span = partialSpans[class_index];
+		if (!span && sweepPending)
+			span = sweepClass(class_index);
+		if (!span) {
+			span = newSpan(class_index);
+			if (!span)
+				break;
+		}
+
+		/* Recycled objects first, one at a time */
+		while (span->freeList && got < count) {
+			obj = (char*)span->freeList;
+			span->freeList = *(void**)obj;
+			span->setAllocated(span->objectIndex(obj));
+			pageHeap.setMark(obj, !markEpoch);
+			span->allocatedCount++;
+			out[got++] = obj;
+		}
+
+		/* Then carve never-used objects off the span in one go */
+		n = span->objectCount - span->freshIndex;
+		if (n > count - got)
+			n = count - got;
+		if (n) {
+			first = span->freshIndex;
+			obj = span->objectAddress(first);
+			for (unsigned i = 0; i < n; i++, obj += size)
+				out[got + i] = obj;
+			span->setAllocated(first, n);
+			pageHeap.setMarks(span->objectAddress(first), size, n, !markEpoch);
+			span->freshIndex += n;
+			span->allocatedCount += n;
+			got += n;
+		}
+
+		if (span->isFull())
+			removePartial(span);
+	}
+
+	/* A little stats */
+	allocated += got * size;
+	bytesAllocatedSinceLastGC += got * size;
+	objectsAllocated += got;
+	return got;
+}
+
+template <class SourceHeap>
+void *GCMalloc<SourceHeap>::allocateLarge(size_t sz, size_t alignment, bool zero)
+{
+	size_t rounded_sz, pages, slack;
+	LargeObject *lo;
+	char *mem, *base;
+	bool zeroed, charged;
+
+	lo = largeMeta.malloc();
+	if (!lo)
+		return NULL;
+
+	/* Runs start on a page; wider alignments over-allocate and trim */
+	slack = alignment - PageRun::PageSize;
+
+	if (sz > HugeThreshold || alignment > HugeThreshold) {
+		/* Huge objects get their own mapping, unmapped again when swept */
+		pages = PAGES(sz);
+		rounded_sz = pages << PageRun::PageShift;
+		/* They count against the heap cap, like the regions */
+		charged = SourceHeap::charge(rounded_sz);
+		if (!charged && sweepPending) {
+			finishSweep();
+			charged = SourceHeap::charge(rounded_sz);
+		}
+		if (!charged) {
+			largeMeta.free(lo);
+			errno = ENOMEM;
+			return NULL;
+		}
+		base = (char*)mmap(NULL, rounded_sz + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (base == MAP_FAILED) {
+			perror("Out of Memory!!");
+			SourceHeap::uncharge(rounded_sz);
+			largeMeta.free(lo);
+			return NULL;
+		}
+		mem = (char*)(((uintptr_t)base + alignment - 1) & ~(alignment - 1));
+		if (mem > base)
+			munmap(base, mem - base);
+		if (base + slack > mem)
+			munmap(mem + rounded_sz, base + slack - mem);
+		lo->kind = PageRun::HugeRun;
+		lo->start = mem;
+		lo->pages = pages;
+		if (!hugeObjects.insert(lo)) {
+			munmap(mem, rounded_sz);
+			SourceHeap::uncharge(rounded_sz);
+			largeMeta.free(lo);
+			return NULL;
+		}
+		if (!hugeLow || mem < hugeLow)
+			hugeLow = mem;
+		if (mem + rounded_sz > hugeHigh)
+			hugeHigh = mem + rounded_sz;
+	} else {
+		/* Best fit from the page heap, rounded to the size class */
+		rounded_sz = getSizeFromClass(getSizeClass(sz));
+		pages = PAGES(rounded_sz);
+		if (sweepPending && pageHeap.getFreePages() < pages + (slack >> PageRun::PageShift))
+			finishSweep();
+		base = pageHeap.allocate(pages + (slack >> PageRun::PageShift), &zeroed);
+		if (!base) {
+			perror("Out of Memory!!");
+			largeMeta.free(lo);
+			return NULL;
+		}
+		mem = (char*)(((uintptr_t)base + alignment - 1) & ~(alignment - 1));
+		lo->kind = PageRun::LargeRun;
+		lo->start = mem;
+		lo->pages = pages;
+		pageHeap.record(lo, true);
+		/* Only once the object is recorded can the trimmed ends coalesce */
+		if (mem > base)
+			pageHeap.release(base, (mem - base) >> PageRun::PageShift);
+		if (base + slack > mem)
+			pageHeap.release(lo->end(), (base + slack - mem) >> PageRun::PageShift);
+		/* Fresh mappings are zero already; recycled pages may not be */
+		if (zero && !zeroed)
+			pageHeap.zero(mem, pages);
+	}
+	lo->objectSize = rounded_sz;
+	lo->marked = !markEpoch;
+	lo->fiberStack = false;
+
+	lo->prev = NULL;
+	lo->next = largeObjects;
+	if (largeObjects)
+		largeObjects->prev = lo;
+	largeObjects = lo;
+
+	/* A little stats */
+	allocated += rounded_sz;
+	bytesAllocatedSinceLastGC += rounded_sz;
+	objectsAllocated += 1;
+	return mem;
+}
+
+template <class SourceHeap>
+bool GCMalloc<SourceHeap>::resizeLarge(LargeObject *lo, size_t sz)
+{
+	size_t new_sz, pages;
+	char *mem;
+
+	/* Markers may be scanning it without the lock */
+	if (markingConcurrently)
+		return false;
+
+	if (lo->kind == PageRun::HugeRun) {
+#if defined(__linux__)
+		/* Let the kernel move the pages instead of copying them */
+		if (sz <= HugeThreshold)
+			return false;
+		pages = PAGES(sz);
+		new_sz = pages << PageRun::PageShift;
+		if (pages > lo->pages && !SourceHeap::charge((pages - lo->pages) << PageRun::PageShift))
+			return false;
+		mem = (char*)mremap(lo->start, lo->pages << PageRun::PageShift, new_sz, MREMAP_MAYMOVE);
+		if (mem == MAP_FAILED) {
+			if (pages > lo->pages)
+				SourceHeap::uncharge((pages - lo->pages) << PageRun::PageShift);
+			return false;
+		}
+		if (pages < lo->pages)
+			SourceHeap::uncharge((lo->pages - pages) << PageRun::PageShift);
+		/* Same number of entries, so re-inserting cannot fail */
+		hugeObjects.remove(lo);
+		lo->start = mem;
+		lo->pages = pages;
+		hugeObjects.insert(lo);
+		if (mem < hugeLow)
+			hugeLow = mem;
+		if (mem + new_sz > hugeHigh)
+			hugeHigh = mem + new_sz;
+#else
 		return false;
-	Header *header;
-	header = (Header*)((char*)p - HEADER_ALIGNED_SIZE);
-	return header->validateCookie();
+#endif
+	} else {
+		/* Grow into the free pages right after it, or give back its tail */
+		if (sz > HugeThreshold)
+			return false;
+		new_sz = getSizeFromClass(getSizeClass(sz));
+		pages = PAGES(new_sz);
+		if (pages != lo->pages && !pageHeap.resize(lo, pages))
+			return false;
+	}
+
+	if (new_sz > lo->objectSize)
+		bytesAllocatedSinceLastGC += new_sz - lo->objectSize;
+	allocated += new_sz;
+	allocated -= lo->objectSize;
+	lo->objectSize = new_sz;
+	return true;
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::freeLarge(LargeObject *lo)
+{
+	if (lo == unsweptLarge)
+		unsweptLarge = lo->next;
+	if (lo->prev)
+		lo->prev->next = lo->next;
+	else
+		largeObjects = (LargeObject*)lo->next;
+	if (lo->next)
+		lo->next->prev = lo->prev;
+
+	allocated -= lo->objectSize;
+	if (lo->kind == PageRun::HugeRun) {
+		hugeObjects.remove(lo);
+		munmap(lo->start, lo->pages << PageRun::PageShift);
+		SourceHeap::uncharge(lo->pages << PageRun::PageShift);
+	} else {
+		pageHeap.release(lo->start, lo->pages);
+	}
+	largeMeta.free(lo);
+}
+
+template <class SourceHeap>
+Span *GCMalloc<SourceHeap>::newSpan(int class_index)
+{
+	Span *span;
+	char *mem;
+
+	/* The unswept spans may hold empty ones, before the heap grows */
+	if (sweepPending && pageHeap.getFreePages() < Span::SpanPages)
+		finishSweep();
+	span = spanMeta.malloc();
+	if (!span)
+		return NULL;
+	mem = pageHeap.allocate(Span::SpanPages);
+	if (!mem) {
+		perror("Out of Memory!!");
+		spanMeta.free(span);
+		return NULL;
+	}
+
+	memset(span, 0, sizeof(Span));
+	span->kind = PageRun::SmallRun;
+	span->start = mem;
+	span->pages = Span::SpanPages;
+	span->sizeClass = class_index;
+	span->objectSize = getSizeFromClass(class_index);
+	span->objectCount = Span::SpanSize / span->objectSize;
+	span->next = allSpans;
+	if (allSpans)
+		allSpans->prev = span;
+	allSpans = span;
+
+	/* Every page maps to the span, so interior pointers resolve directly */
+	pageHeap.record(span, true);
+	addPartial(span);
+	return span;
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::releaseSpan(Span *span)
+{
+	if (span->inPartialList)
+		removePartial(span);
+	if (span->prev)
+		span->prev->next = span->next;
+	else
+		allSpans = (Span*)span->next;
+	if (span->next)
+		span->next->prev = span->prev;
+	pageHeap.release(span->start, span->pages);
+	spanMeta.free(span);
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::freeSmall(Span *span, void *ptr)
+{
+	unsigned index;
+
+	index = span->objectIndex(ptr);
+	if (!span->isAllocated(index))
+		return;
+	span->clearAllocated(index);
+	span->allocatedCount--;
+	*(void**)ptr = span->freeList;
+	span->freeList = ptr;
+	allocated -= span->objectSize;
+	if (!span->inPartialList)
+		addPartial(span);
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::addPartial(Span *span)
+{
+	Span *head = partialSpans[span->sizeClass];
+
+	span->prevPartial = NULL;
+	span->nextPartial = head;
+	if (head)
+		head->prevPartial = span;
+	partialSpans[span->sizeClass] = span;
+	span->inPartialList = true;
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::removePartial(Span *span)
+{
+	if (span->prevPartial)
+		span->prevPartial->nextPartial = span->nextPartial;
+	else
+		partialSpans[span->sizeClass] = span->nextPartial;
+	if (span->nextPartial)
+		span->nextPartial->prevPartial = span->prevPartial;
+	span->prevPartial = span->nextPartial = NULL;
+	span->inPartialList = false;
+}
+
+template <class SourceHeap>
+typename GCMalloc<SourceHeap>::ThreadCache *GCMalloc<SourceHeap>::getThreadCache()
+{
+	ThreadCache *tc;
+
+	tc = threadCache;
+	if (tc)
+		return tc;
+
+	heapLock.lock();
+	tc = freeCaches;
+	if (tc) {
+		freeCaches = tc->nextFree;
+		memset(tc, 0, sizeof(ThreadCache));
+	} else {
+		/* Caches live outside the GC heap; a fresh mapping is already zeroed */
+		tc = (ThreadCache*) mmap(NULL, sizeof(ThreadCache), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (tc == MAP_FAILED) {
+			heapLock.unlock();
+			return NULL;
+		}
+	}
+	tc->heap = this;
+	tc->thread = pthread_self();
+	/* Set before the cache is listed, so a thread that stopWorld() can
+	 * signal always finds it, and before pthread_setspecific and
+	 * getThreadStack, which may themselves call malloc */
+	threadCache = tc;
+	tc->nextCache = allCaches;
+	if (allCaches)
+		allCaches->prevCache = tc;
+	allCaches = tc;
+
+	/* Hold the lock until the stack is known, so that no collection
+	 * stops this thread with no bounds to scan: what getThreadStack
+	 * allocates lives there. Nor can this thread collect before then
+	 * (canCollect) */
+	pthread_setspecific(cacheKey, tc);
+	void *bottom, *top;
+	if (OSSpecific::getThreadStack(bottom, top)) {
+		tc->stackBottom = (char*)bottom;
+		tc->stackTop = (char*)top;
+	}
+	heapLock.unlock();
+
+	if (tc->stackTop) {
+		/* The static TLS blocks, unless they are part of the stack (as
+		 * other threads' are); blocks in the heap belong to modules
+		 * loaded later, and the loader keeps them alive */
+		char *tls[2] = { NULL, NULL };
+		OSSpecific::walkThreadTLS([this, &tls](void *start, void *end){
+			if (inHeap(start))
+				return;
+			if (!tls[0] || (char*)start < tls[0])
+				tls[0] = (char*)start;
+			if ((char*)end > tls[1])
+				tls[1] = (char*)end;
+		});
+		if (tls[0] >= (char*)bottom && tls[1] <= (char*)top)
+			tls[0] = tls[1] = NULL;
+		heapLock.lock();
+		tc->tlsStart = tls[0];
+		tc->tlsEnd = tls[1];
+		heapLock.unlock();
+	}
+	return tc;
+}
+
+template <class SourceHeap>
+bool GCMalloc<SourceHeap>::refillCache(ThreadCache *tc, int class_index)
+{
+	void *objs[CacheBatchObjects];
+	size_t batch, n;
+
+	batch = CacheBatchBytes / getSizeFromClass(class_index);
+	if (batch > CacheBatchObjects)
+		batch = CacheBatchObjects;
+	if (batch < 1)
+		batch = 1;
+
+	heapLock.lock();
+	maybeCollect(getSizeFromClass(class_index));
+	/* An allocation made while collecting may have refilled the class
+	 * already; another batch would grow the list past what
+	 * markCachedObjects walks */
+	if (tc->freeList[class_index]) {
+		heapLock.unlock();
+		return true;
+	}
+
+	n = allocateBatch(class_index, batch, objs);
+	/* Chain them up (before a gc can see them) in address order */
+	while (n--) {
+		*(void**)objs[n] = tc->freeList[class_index];
+		tc->freeList[class_index] = objs[n];
+	}
+	heapLock.unlock();
+
+	return tc->freeList[class_index] != NULL;
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::flushCache(ThreadCache *tc)
+{
+	void *ptr, *next;
+
+	for (int i = 0; i < NumSmallClasses; i++) {
+		for (ptr = tc->freeList[i]; ptr; ptr = next) {
+			next = *(void**)ptr;
+			freeSmall(spanOf(ptr), ptr);
+		}
+		tc->freeList[i] = NULL;
+	}
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::markCachedObjects()
+{
+	ThreadCache *tc;
+	void *ptr;
+	int n;
+
+	for (tc = allCaches; tc; tc = tc->nextCache) {
+		for (int i = 0; i < NumSmallClasses; i++) {
+			/* Another thread may be popping from its cache right now:
+			 * stop at anything that is not one of our objects */
+			ptr = tc->freeList[i];
+			for (n = 0; ptr && n < CacheBatchObjects; n++) {
+				if (findObject(ptr) != ptr)
+					break;
+				pageHeap.setMark(ptr, markEpoch);
+				ptr = *(void**)ptr;
+			}
+		}
+	}
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::releaseThreadCache(void *p)
+{
+	ThreadCache *tc = (ThreadCache*)p;
+	GCMalloc *heap = tc->heap;
+
+	heap->heapLock.lock();
+	heap->flushCache(tc);
+	/* Once unlisted, the thread is no longer stopped for collections */
+	if (tc->prevCache)
+		tc->prevCache->nextCache = tc->nextCache;
+	else
+		heap->allCaches = tc->nextCache;
+	if (tc->nextCache)
+		tc->nextCache->prevCache = tc->prevCache;
+	tc->nextFree = heap->freeCaches;
+	heap->freeCaches = tc;
+	heap->heapLock.unlock();
+	/* A later malloc from this thread (e.g. another destructor) starts a new cache */
+	threadCache = NULL;
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::stopWorld()
+{
+#if !defined(__APPLE__)
+	ThreadCache *tc;
+	unsigned n = 0;
+
+	/* Catch up with dlopen and dlclose while the loader's lock is free */
+	sp.refreshGlobals();
+	worldStopped = true;
+	for (tc = allCaches; tc; tc = tc->nextCache) {
+		/* A thread that already exited (or a stale cache in a forked
+		 * child) cannot be signalled: skip it */
+		tc->stopped = tc != threadCache &&
+			pthread_kill(tc->thread, OSSpecific::SuspendSignal) == 0;
+		n += tc->stopped;
+	}
+	waitForThreads(n);
+#endif
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::startWorld()
+{
+#if !defined(__APPLE__)
+	ThreadCache *tc;
+	unsigned n = 0;
+
+	worldStopped = false;
+	for (tc = allCaches; tc; tc = tc->nextCache) {
+		if (!tc->stopped)
+			continue;
+		tc->stopped = false;
+		pthread_kill(tc->thread, OSSpecific::RestartSignal);
+		n++;
+	}
+	/* Wait until they are out of suspendHandler, so the next stopWorld()
+	 * cannot catch one still inside */
+	waitForThreads(n);
+#endif
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::waitForThreads(unsigned n)
+{
+#if !defined(__APPLE__)
+	static const char msg[] = "gcmalloc: a thread has not answered the stop signal in 10 s, still waiting\n";
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += StopTimeout;
+	while (n) {
+		if (sem_timedwait(&stopAck, &deadline) == 0) {
+			n--;
+		} else if (errno == ETIMEDOUT) {
+			/* Not through stdio, which may allocate or hold a lock
+			 * the stuck thread wants */
+			auto unused = write(2, msg, sizeof(msg) - 1);
+			(void) unused;
+			break;
+		}
+	}
+	while (n)
+		if (sem_wait(&stopAck) == 0)
+			n--;
+#endif
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::suspendHandler(int, siginfo_t *, void *context)
+{
+#if !defined(__APPLE__)
+	ThreadCache *tc = threadCache;
+	GCMalloc *heap;
+	char *here = (char*)__builtin_frame_address(0);
+	int saved_errno = errno;
+	sigset_t mask;
+
+	/* Not a thread stopWorld() signalled: one without a cache, or one
+	 * that sent the signal itself */
+	if (!tc)
+		return;
+	heap = tc->heap;
+	/* The interrupted frames lie above this one, unless the handler runs
+	 * on an alternate signal stack: then scan the whole stack */
+	if (here >= tc->stackBottom && here < tc->stackTop)
+		tc->stackPointer = here;
+	else
+		tc->stackPointer = tc->stackBottom;
+	OSSpecific::saveRegisters(context, tc->registers);
+	sem_post(&heap->stopAck);
+
+	/* The restart signal is blocked until sigsuspend, so it cannot be lost */
+	sigfillset(&mask);
+	sigdelset(&mask, OSSpecific::RestartSignal);
+	while (heap->worldStopped)
+		sigsuspend(&mask);
+	sem_post(&heap->stopAck);
+	errno = saved_errno;
+#endif
+}
+
+template <class SourceHeap>
+void GCMalloc<SourceHeap>::restartHandler(int)
+{
+	/* Only here to interrupt sigsuspend in suspendHandler */
 }
@@ -2,49 +2,101 @@
 #define GCMALLOC_H
 
 #include <cassert>
+#include <cerrno>
 #include <functional>
 #include <cstdlib>
-#include <cmath>
 #include <iostream>
 #include <new>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <cstring>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/mman.h>
 
 #include "tprintf.hh"
 #include "os_specific.hh"
+#include "markstack.hh"
+#include "metaheap.hh"
+#include "pageheap.hh"
+#include "sizeclass.hh"
 
 using namespace std;
 
-class Header {
+// Page-level metadata for a span: a fixed-size, page-aligned run of
+// memory carved into objects of a single small size class. Objects in
+// a span carry no header; their size and allocation state live here,
+// and their mark bits in the page heap's bitmap, all outside the span.
+class Span : public PageRun {
 public:
-  bool isMarked() {
-    return allocatedSize & 1;
+  // Every span covers the same number of pages.
+  enum { SpanPages = 16, SpanSize = SpanPages * PageSize };
+  // Spans of the smallest (16-byte) class hold the most objects.
+  enum { MaxObjects = SpanSize / 16, BitmapWords = MaxObjects / 64 };
+
+  // Index of the object containing p (which must lie in the span).
+  unsigned objectIndex(void * p) {
+    return (unsigned) (((char *) p - start) / objectSize);
   }
-  void mark() {
-    allocatedSize |= 1;
+  char * objectAddress(unsigned i) {
+    return start + (size_t) i * objectSize;
   }
-  void clear() {
-    allocatedSize &= ~1;
+  // True iff p lies within one of the span's objects (not the tail slack).
+  bool inObjectArea(void * p) {
+    return (char *) p >= start && (char *) p < start + (size_t) objectCount * objectSize;
   }
-  size_t getAllocatedSize() {
-    return allocatedSize & ~1;
+  bool isFull() {
+    return allocatedCount == objectCount;
   }
-  void setAllocatedSize(size_t sz) {
-    allocatedSize = sz;
+  bool isEmpty() {
+    return allocatedCount == 0;
   }
-  bool validateCookie() {
-    return (cookie == ((uintptr_t) 0xdeadbeef ^ (uintptr_t) this));
+  bool isAllocated(unsigned i) {
+    return (allocBits[i / 64] >> (i % 64)) & 1;
   }
-  void setCookie() {
-    cookie = (uintptr_t) 0xdeadbeef ^ (uintptr_t) this;
+  void setAllocated(unsigned i) {
+    allocBits[i / 64] |= 1UL << (i % 64);
   }
-private:
-  size_t cookie;  // magic number at the start of every object
-  size_t allocatedSize; // how much space was allocated for it (mark bits encoded here)
+  // Set the allocation bits of objects [first, first + n), a word at a time.
+  void setAllocated(unsigned first, unsigned n) {
+    while (n) {
+      unsigned bit = first % 64;
+      unsigned len = (n < 64 - bit) ? n : 64 - bit;
+      uint64_t bits = (len == 64) ? ~0UL : ((1UL << len) - 1) << bit;
+      allocBits[first / 64] |= bits;
+      first += len;
+      n -= len;
+    }
+  }
+  void clearAllocated(unsigned i) {
+    allocBits[i / 64] &= ~(1UL << (i % 64));
+  }
+
+  size_t objectSize;      // size of every object in the span
+  int sizeClass;
+  unsigned objectCount;   // objects that fit in the span
+  unsigned allocatedCount;
+  unsigned freshIndex;    // objects at or above this index were never handed out
+  void * freeList;        // freed objects, linked through their first word
+  bool inPartialList;
+  // Spans of the same class with free objects (doubly linked).
+  Span * prevPartial;
+  Span * nextPartial;
+  // Spans of the same class a lazy sweep has yet to reach.
+  Span * nextUnswept;
+  uint64_t allocBits[BitmapWords];
+};
+
+// Metadata for one object above Threshold. Large objects occupy a run
+// of pages from the page heap; huge ones get a mapping of their own.
+// Either way the object starts at the run's first byte.
+class LargeObject : public PageRun {
 public:
-  // prev and next objects, whether allocated or freed.
-  Header * prevObject;
-  Header * nextObject;
+  size_t objectSize;      // usable size
+  bool marked;            // marked iff equal to the heap's markEpoch
+  bool fiberStack;        // holds a registered fiber's stack, scanned as a root
 };
 
 template <class SourceHeap>
@@ -62,6 +114,22 @@ public:
   // Allocate an object of at least the requested size.
   void * malloc(size_t sz);
 
+  // Allocate up to count objects of at least sz bytes each into out.
+  // Returns how many were allocated (fewer only when memory runs out).
+  size_t mallocBatch(size_t sz, size_t count, void ** out);
+
+  // Allocate a zero-filled array, skipping the clearing when the memory
+  // is known to be zero already.
+  void * calloc(size_t nelem, size_t elsize);
+
+  // Resize an object, in place when possible; otherwise move it to a new
+  // object. Returns NULL (leaving ptr alone) on failure.
+  void * realloc(void * ptr, size_t sz);
+
+  // Allocate an object of at least the requested size whose address is a
+  // multiple of alignment (a power of two). Returns NULL otherwise.
+  void * memalign(size_t alignment, size_t sz);
+
   // Free an object.
   void free(void * ptr) {
     // in a garbage-collected context, free() is a NOP.
@@ -70,22 +138,516 @@ public:
   // Return the size of the given object.
   size_t getSize(void * p);
 
+  // Note the code that allocated or freed ptr (the return address of
+  // the malloc family call): the dynamic loader's objects stay alive
+  // until the loader frees them.
+  void noteAllocation(void * ptr, void * caller) {
+    if (ptr && sp.isLoaderCode(caller)) {
+      addLoaderObject(ptr);
+    }
+  }
+  void noteFree(void * ptr, void * caller) {
+    if (ptr && sp.isLoaderCode(caller)) {
+      removeLoaderObject(ptr);
+    }
+  }
+
+  // The code whose allocations are worth noting, for the wrapper to
+  // check before it calls in.
+  pair<void *, void *> getLoaderText() {
+    return sp.getLoaderText();
+  }
+
+  // Scan [start, end) as a root in every collection from now on, or stop
+  // doing so for the parts of it added. Return false when there are too
+  // many ranges.
+  bool addRoots(void * start, void * end);
+  bool removeRoots(void * start, void * end);
+
+  // Leave [start, end) out of the globals scanned: it holds no references.
+  bool excludeRoots(void * start, void * end);
+
+  // A fiber (user-space thread) whose stack the collector knows about.
+  class Fiber;
+
+  // Register the stack [stack, stack + size) of a fiber, which may be an
+  // object from this heap. From then on the stack and its object stay
+  // alive, and a suspended fiber's stack is scanned from its saved stack
+  // pointer up, along with the registers its last switch saved. Returns
+  // NULL when out of memory.
+  Fiber * registerFiber(void * stack, size_t size);
+  void unregisterFiber(Fiber * f);
+
+  // Called on f's own thread just before it switches away from f: f's
+  // stack is in use from sp up (NULL: from the caller's frame up), and
+  // the switch saves its registers in [regs, regs + len), scanned in
+  // place while f is suspended (empty if they go on the stack above sp).
+  // resumeFiber is called on f's stack once f runs again.
+  static void suspendFiber(Fiber * f, void * sp, void * regs, size_t len);
+  static void resumeFiber(Fiber * f);
+
+  // Create a thread that registers with the collector before calling
+  // start(arg); until then, arg counts as a root.
+  int createThread(pthread_t * thread, const pthread_attr_t * attr,
+		   void *(*start)(void *), void * arg);
+
   // number of bytes currently allocated  
   size_t bytesAllocated();
+
+  // Collect, then give every free page back to the OS.
+  // Returns the number of bytes purged.
+  size_t trim();
+
+  // Print allocation and collection statistics.
+  void printStats();
   
   // Execute the given function on every allocated object.
-  void walk(const std::function< void(Header *) >& f); 
+  void walk(const std::function< void(void *) >& f); 
 
   // Return maximum size of object for a given size class.
-  static size_t getSizeFromClass(int index);
+  static size_t getSizeFromClass(int index) {
+    return SizeClass::getSizeFromClass(index);
+  }
   
   // Return the size class for a given size.
-  static int constexpr getSizeClass(size_t sz);
+  static int constexpr getSizeClass(size_t sz) {
+    return SizeClass::getSizeClass(sz);
+  }
+
+  // Return the size malloc(sz) really gives: its class's, or whole
+  // pages for a huge object.
+  static size_t getGoodSize(size_t sz) {
+    if (sz > HugeThreshold) {
+      return (sz + PageRun::PageSize - 1) & ~(size_t) (PageRun::PageSize - 1);
+    }
+    return getSizeFromClass(getSizeClass(sz));
+  }
 
 private:
 
+  // Each object's size is rounded up to at least a multiple of Base.
+  static const auto Base = SizeClass::Base;
+  
+  // We maintain exact size classes (multiples of Base) until this threshold.
+  static const auto Threshold = SizeClass::Threshold;
+
+  // Number of size classes (exact classes, then four per power of two up to 512 MB).
+  enum { NumClasses = SizeClass::NumClasses };
+
+  // Classes up to Threshold are small: they live in spans and are cached per thread.
+  enum { NumSmallClasses = SizeClass::SmallClasses };
+
+  // Objects above this size get a mapping of their own.
+  enum { HugeThreshold = 1024 * 1024 };
+
+  // Free pages left untouched this long (ms) are returned to the OS after a collection.
+  enum { PurgeDecay = 1000 };
+
+  // Candidate pointers queued by each marker while their metadata loads.
+  enum { PrefetchDepth = 8 };
+
+  // Upper bound on the marking threads, the collecting thread included.
+  enum { MaxMarkers = 64 };
+
+  // Big objects and root ranges are scanned this many bytes at a time;
+  // the rest waits on the mark stack, where other markers can steal it.
+  enum { MarkChunkBytes = 64 * 1024 };
+
+  // Seconds to wait for the other threads to stop or resume before
+  // reporting them stuck.
+  enum { StopTimeout = 10 };
+
+  // Upper bound on the entries one steal takes.
+  enum { StealBatch = 32 };
+
+  // Bytes an incremental mark scans for every byte allocated meanwhile,
+  // so it ends before the heap has grown by half its live size.
+  enum { MarkWorkRatio = 2 };
+
+  // One marking thread's state. Marker 0 is the collecting thread; the
+  // others are pool threads that sleep between collections.
+  class Marker {
+  public:
+    Marker()
+      : pending (0),
+	prefetchHead (0),
+	prefetchCount (0),
+	heap (nullptr),
+	id (0)
+    {
+    }
+    // Marked objects and root ranges waiting to be scanned, and a lock
+    // against thieves.
+    MarkStack stack;
+    mutex lock;
+    // The size of stack, readable without the lock.
+    atomic<size_t> pending;
+    // Ring of candidates for markObject, oldest at prefetchHead.
+    void * prefetchQueue[PrefetchDepth];
+    unsigned prefetchHead;
+    unsigned prefetchCount;
+    GCMalloc * heap;
+    unsigned id;
+  };
+
+  // Upper bound on the bytes moved into a thread cache by one refill.
+  enum { CacheBatchBytes = 32768 };
+
+  // Upper bound on the objects moved into a thread cache by one refill.
+  enum { CacheBatchObjects = 64 };
+
+  // Free objects held by one thread, one chain per small size class, so
+  // that the common malloc path touches neither heapLock nor any span.
+  // Cached objects already count as allocated in their spans; gc() marks
+  // them so that sweep() does not hand them out a second time.
+  // A cache also registers its thread with the collector, which stops
+  // the thread and scans its stack and registers.
+  class ThreadCache {
+  public:
+    // Cached free objects, linked through their first word.
+    void * freeList[NumSmallClasses];
+    // The heap this cache belongs to (for the thread exit destructor).
+    GCMalloc * heap;
+    // All live caches, so gc() can find their objects and threads.
+    ThreadCache * prevCache;
+    ThreadCache * nextCache;
+    // The owning thread, and the bounds of its stack (NULL until known).
+    pthread_t thread;
+    char * stackBottom;
+    char * stackTop;
+    // Did the last stopWorld() stop the thread? If so, where its stack
+    // pointer was and what its registers held at the time.
+    bool stopped;
+    char * stackPointer;
+    OSSpecific::Registers registers;
+    // The thread's static TLS blocks, when they lie outside its stack
+    // (as the main thread's do); NULL otherwise.
+    char * tlsStart;
+    char * tlsEnd;
+    // Next cache in the pool of caches released by exited threads.
+    ThreadCache * nextFree;
+  };
+
+  // A thread being started by createThread, and what it is to run.
+  class ThreadStart {
+  public:
+    void *(*start)(void *);
+    void * arg;
+    GCMalloc * heap;
+    // All threads not yet running start.
+    ThreadStart * prevStart;
+    ThreadStart * nextStart;
+  };
+
+public:
+  class Fiber {
+  public:
+    // The fiber's stack, and the heap object holding it (if any).
+    char * stack;
+    char * stackEnd;
+    LargeObject * object;
+    // As of the last suspendFiber, which sets suspended last.
+    char * stackPointer;
+    char * registersStart;
+    char * registersEnd;
+    bool suspended;
+    // All registered fibers.
+    Fiber * prevFiber;
+    Fiber * nextFiber;
+  };
+
+private:
+
+  // Body of threads started by createThread: register, then run start.
+  static void * threadMain(void * ts);
+
+  // Remove ts from threadStarts and free it. Call with heapLock held.
+  void releaseThreadStart(ThreadStart * ts);
+
+  // The calling thread's cache (initial-exec so lookups never allocate).
+  static __thread ThreadCache * threadCache
+    __attribute__((tls_model("initial-exec")));
+
+  // Return the calling thread's cache, creating it on first use.
+  ThreadCache * getThreadCache();
+
+  // Move a batch of objects of the given class into the cache.
+  // Returns false if out of memory. Takes heapLock.
+  bool refillCache(ThreadCache * tc, int class_index);
+
+  // Return all of a cache's objects to their spans. Call with heapLock held.
+  void flushCache(ThreadCache * tc);
+
+  // Mark the objects sitting in every thread's cache. Call with heapLock held.
+  void markCachedObjects();
+
+  // pthread key destructor: flush and recycle an exiting thread's cache.
+  static void releaseThreadCache(void * tc);
+
+  // Stop every other thread with a cache, recording where each one's
+  // stack pointer and registers were. Call with heapLock held.
+  void stopWorld();
+
+  // Let the threads stopped by stopWorld() run again.
+  void startWorld();
+
+  // Wait for n posts of stopAck, saying so on stderr if they take more
+  // than StopTimeout seconds.
+  void waitForThreads(unsigned n);
+
+  // Handlers of the suspend and restart signals. A thread stays in the
+  // suspend handler until startWorld().
+  static void suspendHandler(int, siginfo_t *, void * context);
+  static void restartHandler(int);
+
+  // Allocate one object of a small class from its spans. Call with heapLock held.
+  void * allocateSmall(int class_index);
+
+  // Allocate up to count objects of a small class into out, those carved
+  // from never-used slots contiguously. Returns how many were allocated.
+  // Call with heapLock held.
+  size_t allocateBatch(int class_index, size_t count, void ** out);
+
+  // Allocate one object above Threshold (or one needing more than page
+  // alignment): from the page heap, or from a mapping of its own above
+  // HugeThreshold. If zero is set, the object reads as zero.
+  // Call with heapLock held.
+  void * allocateLarge(size_t sz, size_t alignment = PageRun::PageSize, bool zero = false);
+
+  // Carve a new span for the given class out of the page heap.
+  Span * newSpan(int class_index);
+
+  // Resize a large or huge object in place (huge ones may move, through
+  // mremap). Returns false if it must be copied. Call with heapLock held.
+  bool resizeLarge(LargeObject * lo, size_t sz);
+
+  // Give an empty span's pages back to the page heap.
+  void releaseSpan(Span * span);
+
+  // Return one object to its span. Call with heapLock held.
+  void freeSmall(Span * span, void * ptr);
+
+  // Release a large or huge object. Call with heapLock held.
+  void freeLarge(LargeObject * lo);
+
+  // Reclaim the objects of one span not marked in sweepEpoch.
+  void sweepSpan(Span * span);
+
+  // Queue every span and large object for a lazy sweep.
+  void queueSweep();
+
+  // Sweep queued spans of the class until one has a free object, and
+  // return it (NULL if none does).
+  Span * sweepClass(int class_index);
+
+  // Sweep up to n queued spans and large objects; all of them if n is
+  // zero. Returns true if some are left. Takes heapLock.
+  bool sweepSome(size_t n);
+  void finishSweep() {
+    if (sweepPending) {
+      sweepSome(0);
+    }
+  }
+
+  // Body of the thread that finishes lazy sweeps in the background.
+  static void * sweeperMain(void * heap);
+
+  // Add or remove a span from its class's list of spans with free objects.
+  void addPartial(Span * span);
+  void removePartial(Span * span);
+
+  // Return the span holding p, or NULL if p is not in a span.
+  Span * spanOf(void * p) {
+    auto run = pageHeap.lookup(p);
+    return (run && run->kind == PageRun::SmallRun) ? (Span *) run : NULL;
+  }
+
+  // True iff p lies in the page heap's regions or among the huge objects.
+  bool inHeap(void * p) {
+    return pageHeap.contains(p) || (p >= hugeLow && p < hugeHigh);
+  }
+
+  // Return the run (span, large or huge object) holding p, or NULL.
+  PageRun * findRun(void * p);
+
+  // Return the start of the allocated object containing p, or NULL.
+  // If run is given, it receives the run holding the object.
+  void * findObject(void * p, PageRun ** run = NULL);
+
+  // Is the object starting at block (in the given run) marked?
+  bool isMarked(PageRun * run, void * block);
+
+  // Monotonic time in ns, for the collection statistics.
+  static uint64_t nanoTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+  // Queue p, if it points into the heap, to have its object marked once
+  // PrefetchDepth more candidates have been queued behind it, so that the
+  // metadata for several candidates is in flight at once.
+  void markPointer(Marker * m, void * p);
+
+  // Mark the queued candidates that are still waiting.
+  void flushPrefetchQueue(Marker * m);
+
+  // Mark the object that p points into, if no marker has yet, and push
+  // it onto m's mark stack to be scanned.
+  void markObject(Marker * m, void * p);
+
+  // Push or pop a range on m's mark stack. Returns false if there is
+  // no room (or nothing to pop).
+  bool pushMark(Marker * m, char * start, char * end);
+  bool popMark(Marker * m, MarkStack::Entry & e);
+
+  // Move some of another marker's work onto m's stack. Returns false if
+  // there was none.
+  bool stealMarks(Marker * m);
+
+  // Scan one entry, or its first chunk if it is big.
+  void scanEntry(Marker * m, MarkStack::Entry & e);
+
+  // Scan, steal and scan again until every marker runs out of work.
+  void markLoop(Marker * m);
+
+  // Body of the pool threads: a markLoop per marking round.
+  static void * markerMain(void * marker);
+
+  // Start the pool threads (on the first collection).
+  void startMarkers();
+
+  // Run a marking round on every marker and wait for it to end.
+  void runMarkers();
+
+  // Scan pushed objects until none is left, recovering from overflow.
+  void drainMarkStack();
+
+  // Scan every marked object again, to find the children of those the
+  // mark stack had no room for.
+  void rescanMarked();
+
+  // The markers, and how many take part in marking: GCMALLOC_MARKERS,
+  // or by default the processors available to the process.
+  Marker markers[MaxMarkers];
+  unsigned markerCount;
+  bool markersStarted;
+
+  // Wakes the pool for a round, and tells the collector it has ended.
+  mutex markerLock;
+  condition_variable markerWake;
+  condition_variable markerDone;
+  unsigned long markRound;
+  unsigned markersBusy;
+
+  // Markers that found no work this round.
+  atomic<unsigned> idleMarkers;
+
+  // pthread_atfork handlers for the one heap (forkHeap). The parent holds
+  // heapLock across the fork, between collections and with no sweep
+  // left pending; the child, left with only the forking thread, takes
+  // its locks afresh and starts its own marker pool and sweeper at its
+  // first collection.
+  static void prepareFork();
+  static void parentAfterFork();
+  static void childAfterFork();
+  static GCMalloc * forkHeap;
+
+  // Did a push fail since the last rescan?
+  atomic<bool> markStackOverflowed;
+
+  // Mark with heapLock released where the kernel tracks soft-dirty pages
+  // (GCMALLOC_CONCURRENT=1), and whether such a mark (or an incremental
+  // one) is running now.
+  bool concurrentMarking;
+  bool markingConcurrently;
+
+  // Sweep after the world restarts, a little at a time: allocation
+  // sweeps queued spans of the class it needs before taking new pages
+  // (and everything, when pages run short), and a background thread
+  // sweeps the rest SweepChunk at a time (GCMALLOC_LAZY_SWEEP=1).
+  enum { SweepChunk = 64 };
+  bool lazySweeping;
+  bool sweeperStarted;
+
+  // Is a lazy sweep under way? Then the spans of each small class it
+  // has yet to reach, how many in all, and the first large object it
+  // has yet to reach (older ones follow it in largeObjects; newer ones
+  // precede it).
+  bool sweepPending;
+  Span * unsweptSpans[NumSmallClasses];
+  size_t unsweptCount;
+  PageRun * unsweptLarge;
+
+  // The markEpoch of the mark being swept: it flips before a lazy sweep
+  // ends, and objects allocated meanwhile get this mark.
+  bool sweepEpoch;
+
+  // Wakes the sweeper for each lazy sweep.
+  mutex sweepLock;
+  condition_variable sweepWake;
+  unsigned long sweepRound;
+
+  // Is an incremental mark under way? Slices of it run in the allocation
+  // slow path, each for at most markBudget ns (GCMALLOC_PAUSE_US; zero
+  // turns incremental marking off). The slices start from the globals
+  // and the loader's objects; the stacks, and the pages written since
+  // the mark began, are scanned by the final remark with the world
+  // stopped. The budget bounds the slices only: the remark grows with
+  // the threads' stacks and with what the program writes while the
+  // slices run, and printStats reports its longest pause apart.
+  bool incrementalMarking;
+  uint64_t markBudget;
+
+  // bytesAllocatedSinceLastGC as of the last slice.
+  size_t sliceAllocated;
+
+  // All live caches.
+  ThreadCache * allCaches;
+
+  // Key whose destructor releases a thread's cache on exit.
+  pthread_key_t cacheKey;
+
+  // Caches released by exited threads, ready for reuse.
+  ThreadCache * freeCaches;
+
+  // Threads created but not yet registered.
+  ThreadStart * threadStarts;
+
+  // Every registered fiber. Guarded by heapLock; a fiber's switches only
+  // write its own fields, and the collector reads those with the world
+  // stopped.
+  Fiber * fibers;
+
+  // Set while stopWorld() holds the other threads; each posts stopAck
+  // once stopped and again once it resumes.
+  atomic<bool> worldStopped;
+  sem_t stopAck;
+
+  // Skip the global pages holding no heap pointers until they are
+  // written, as told by their soft-dirty bits? Only in a stop-the-world
+  // mark whose globals are at least GlobalTrackingMin bytes and
+  // 1/GlobalTrackingRatio of the heap: tracking the writes means clearing
+  // the bits of the whole process, after which the first write to every
+  // page faults. (A concurrent or incremental mark clears them for its
+  // own use, losing what the last collection found.)
+  enum { GlobalTrackingMin = 1 << 20, GlobalTrackingRatio = 8 };
+  bool trackGlobals;
+
+  // Objects the dynamic loader allocated and has not freed, kept in an
+  // anonymous mapping and scanned as a root: the loader keeps pointers to
+  // some (such as the TLS tables of exited threads' cached stacks) where
+  // the collector cannot see them. Guarded by heapLock.
+  enum { MaxLoaderObjects = 1 << 20 };
+  void ** loaderObjects;
+  size_t loaderObjectCount;
+
+  // Add or remove one of the loader's objects. Take heapLock.
+  void addLoaderObject(void * ptr);
+  void removeLoaderObject(void * ptr);
+
   // Scan through this region of memory looking for pointers to mark (and mark them).
-  void scan(void * start, void * end);
+  void scan(Marker * m, void * start, void * end);
   
   // Indicate whether it is time to trigger a garbage collection
   // (call this inside your malloc).
@@ -94,21 +656,47 @@ private:
   // (though not too frequently) using the fields below.
   bool triggerGC(size_t szRequested);
 
-  // Perform a garbage collection pass.
+  // Is the heap about to run out for a request of this size?
+  bool memoryShort(size_t szRequested);
+
+  // Collect, or do a slice of an incremental mark, if it is time to.
+  // Call with heapLock held.
+  void maybeCollect(size_t szRequested);
+
+  // Start an incremental mark: clear the soft-dirty bits, push the roots
+  // and do the first slice. Returns false if soft-dirty bits are not
+  // available to catch the writes made between slices.
+  bool startIncrementalMark();
+
+  // Scan for at most markBudget ns, and at least MarkWorkRatio times the
+  // bytes allocated since the last slice; finish the collection once
+  // nothing is left to scan.
+  void markSlice();
+
+  // Can the calling thread collect? Only once it is registered and its
+  // stack bounds are known (reading them may allocate).
+  bool canCollect() {
+    return threadCache != NULL && threadCache->stackTop != NULL;
+  }
+
+  // Perform a garbage collection pass. Call with heapLock held (once:
+  // a concurrent mark releases it while marking).
   void gc();
+
+  // After a concurrent mark, with heapLock held again: scan what was
+  // written meanwhile (the soft-dirty parts of marked objects, and the
+  // roots) and mark what it reaches.
+  void remark();
   
   // Mark all reachable objects.
   void mark();
 
-  // Mark one object as reachable and recursively mark everything reachable from it.
-  void markReachable(void * ptr);
+  // Push the roots onto the collecting thread's mark stack.
+  void pushRoots();
 
   // Reclaim all unreachable objects (add to free lists).
   void sweep();
 
-  // Free one object.
-  void privateFree(void *);
-
   // Returns true if the argument looks like a pointer that we allocated.
   // This should be as precise as possible without ignoring real allocated objects.
   // Just returning true is *not* an option :)
@@ -123,91 +711,69 @@ private:
   // Track the amount of memory freed by the last garbage collection.
   long bytesReclaimedLastGC;
   
-  // The start of the heap (assume it is contiguous).
-  void * startHeap;
-  
-  // The _current_ end of the heap (it should grow on demand).
-  void * endHeap;
+  // Bounds of the addresses of huge objects (outside the heap).
+  void * hugeLow;
+  void * hugeHigh;
 
   // The lock that protects the heap.
   recursive_mutex heapLock;
 
-  // Each object's size is rounded up to at least a multiple of Base.
-  static const auto Base = 16;
-  
-  // We maintain exact size classes (multiples of Base) until this threshold.
-  static const auto Threshold = 16384;
-
   // Number of objects allocated to date.
   size_t objectsAllocated;
   
   // The amount of memory currently allocated.
   size_t allocated;
 
-  // The list of allocated objects.
-  Header * allocatedObjects;
+  // Collections to date, the time (ns) they spent marking and sweeping,
+  // and how much of it was with heapLock held. The longest pause of an
+  // incremental mark's remark is kept apart from that of the slices and
+  // of whole collections.
+  size_t collections;
+  uint64_t markTime;
+  uint64_t sweepTime;
+  uint64_t pauseTime;
+  uint64_t maxPause;
+  uint64_t maxRemark;
+
+  // The list of allocated objects above Threshold (large and huge).
+  LargeObject * largeObjects;
+
+  // Spans with free objects, organized by (small) size classes.
+  Span * partialSpans[NumSmallClasses];
+
+  // Every span, newest first.
+  Span * allSpans;
+
+  // Runs of pages for spans and large objects, with the page map.
+  PageHeap<SourceHeap> pageHeap;
 
-  // The lists of freed objects, organized by size classes.
-  Header * freedObjects[Threshold / Base + 32];
+  // Huge objects, by address.
+  RunTable hugeObjects;
+
+  // Storage for span and large object descriptors.
+  MetaHeap<Span> spanMeta;
+  MetaHeap<LargeObject> largeMeta;
+  MetaHeap<ThreadStart> startMeta;
+  MetaHeap<Fiber> fiberMeta;
 
   // Is everything ready? If not, malloc should just request from the
   // source heap and return that memory.
   bool initialized;
 
+  // The mark bit value that means marked. It flips after every mark,
+  // turning every survivor's mark into unmarked without a clearing
+  // pass; allocation sets new objects' bits to unmarked.
+  bool markEpoch;
+
   // Are we currently in a GC? (used to avoid reentrancy issues)
   bool inGC;
 
   // After allocating this many bytes, we can trigger a GC (optional).
   long nextGC;
-  
-  /// Quickly calculate the CEILING of the log (base 2) of the argument.
-#if defined(_WIN32)
-  static inline int log2 (size_t sz) 
-  {
-    int retval;
-    sz = (sz << 1) - 1;
-    __asm {
-      bsr eax, sz
-	mov retval, eax
-	}
-    return retval;
-  }
-#elif defined(__GNUC__) && defined(__i386__)
-  static inline int log2 (size_t sz) 
-  {
-    sz = (sz << 1) - 1;
-    asm ("bsrl %0, %0" : "=r" (sz) : "0" (sz));
-    return (int) sz;
-  }
-#elif defined(__GNUC__) && defined(__x86_64__)
-  static inline int log2 (size_t sz) 
-  {
-    sz = (sz << 1) - 1;
-    asm ("bsrq %0, %0" : "=r" (sz) : "0" (sz));
-    return (int) sz;
-  }
-#elif defined(__GNUC__)
-  // Just use the intrinsic.
-  static inline constexpr int log2 (size_t sz) 
-  {
-    sz = (sz << 1) - 1;
-    return (sizeof(unsigned long) * 8) - __builtin_clzl(sz) - 1;
-  }
-#else
-  static inline int log2 (size_t v) {
-    int log = 0;
-    unsigned int value = 1;
-    while (value < v) {
-      value <<= 1;
-      log++;
-    }
-    return log;
-  }
-#endif
-  
+
 };
 /* temporarily added for test purposes */
 /*extern "C" {
-  void walk(const std::function< void(Header *) > f);
+  void walk(const std::function< void(void *) > f);
 }*/
 #endif
@@ -19,6 +19,7 @@
 #include <malloc.h>
 #include <new>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/cdefs.h>
 
 /*
@@ -66,7 +67,40 @@ extern "C" {
   WEAK_REDEF3(int, posix_memalign, void **, size_t, size_t);
   WEAK_REDEF2(void *, aligned_alloc, size_t, size_t);
   WEAK_REDEF1(size_t, malloc_usable_size, void *);
+  WEAK_REDEF1(int, malloc_trim, size_t);
+  WEAK_REDEF1(void, malloc_stats, void);
 }
 
 #include "wrapper.cpp"
 #include "gnuwrapper-hooks.cpp"
+
+#ifndef __THROWNL
+#define __THROWNL __THROW
+#endif
+
+extern "C" {
+  // Starts a thread that is registered with the collector before it
+  // runs, keeping arg reachable until then.
+  int xxpthread_create(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *);
+
+  int pthread_create(pthread_t * thread, const pthread_attr_t * attr,
+		     void *(*start)(void *), void * arg) __THROWNL
+  {
+    return xxpthread_create(thread, attr, start, arg);
+  }
+
+  // Change the signal mask, leaving the collector's stop and restart
+  // signals unblocked.
+  int xxpthread_sigmask(int, const sigset_t *, sigset_t *);
+  int xxsigprocmask(int, const sigset_t *, sigset_t *);
+
+  int pthread_sigmask(int how, const sigset_t * set, sigset_t * old) __THROW
+  {
+    return xxpthread_sigmask(how, set, old);
+  }
+
+  int sigprocmask(int how, const sigset_t * set, sigset_t * old) __THROW
+  {
+    return xxsigprocmask(how, set, old);
+  }
+}
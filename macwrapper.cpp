@@ -56,9 +56,24 @@ extern "C" {
   void * xxmalloc (size_t);
   void   xxfree (void *);
 
+  // Returns a zero-filled array, clearing only memory that may be dirty.
+  void * xxcalloc (size_t, size_t);
+
+  // Allocates up to count objects of the given size; returns how many.
+  size_t xxmalloc_batch (size_t, size_t, void **);
+
+  // Resizes an object, in place when possible; NULL on failure.
+  void * xxrealloc (void *, size_t);
+
+  // Returns an object aligned to the given power of two, or NULL.
+  void * xxmemalign (size_t, size_t);
+
   // Takes a pointer and returns how much space it holds.
   size_t xxmalloc_usable_size (void *);
 
+  // Returns how much space an allocation of the given size would hold.
+  size_t xxmalloc_good_size (size_t);
+
   // Locks the heap(s), used prior to any invocation of fork().
   void xxmalloc_lock ();
 
@@ -96,10 +111,7 @@ extern "C" {
   }
 
   size_t MACWRAPPER_PREFIX(malloc_good_size) (size_t sz) {
-    auto * ptr = MACWRAPPER_PREFIX(malloc)(sz);
-    auto objSize = MACWRAPPER_PREFIX(malloc_usable_size)(ptr);
-    MACWRAPPER_PREFIX(free)(ptr);
-    return objSize;
+    return xxmalloc_good_size(sz);
   }
 
   static void * _extended_realloc (void * ptr, size_t sz, bool isReallocf) 
@@ -116,38 +128,13 @@ extern "C" {
       return MACWRAPPER_PREFIX(malloc)(1);
     }
 
-    auto objSize = MACWRAPPER_PREFIX(malloc_usable_size)(ptr);
-
-    // Custom logic here to ensure we only do a logarithmic number of
-    // reallocations (with a constant space overhead).
-
-    // Don't change size if the object is shrinking by less than half.
-    if ((objSize / 2 < sz) && (sz <= objSize)) {
-      // Do nothing.
-      return ptr;
-    }
-#if 0
-    // If the object is growing by less than 2X, double it.
-    if ((objSize < sz) && (sz < objSize * 2)) {
-      sz = objSize * 2;
-    }
-#endif
-
-    auto * buf = MACWRAPPER_PREFIX(malloc)((size_t) (sz));
+    // Resizes in place when it can, copies otherwise.
+    auto * buf = xxrealloc (ptr, sz);
 
-    if (buf != NULL) {
-      // Successful malloc.
-      // Copy the contents of the original object
-      // up to the size of the new block.
-      auto minSize = (objSize < sz) ? objSize : sz;
-      memcpy (buf, ptr, minSize);
+    if (buf == NULL && isReallocf) {
+      // Free the old block if the new allocation failed.
+      // Specific behavior for Mac OS X reallocf().
       MACWRAPPER_PREFIX(free) (ptr);
-    } else {
-      if (isReallocf) {
-	// Free the old block if the new allocation failed.
-	// Specific behavior for Mac OS X reallocf().
-	MACWRAPPER_PREFIX(free) (ptr);
-      }
     }
 
     // Return a pointer to the new one.
@@ -164,14 +151,13 @@ extern "C" {
 
   void * MACWRAPPER_PREFIX(calloc) (size_t elsize, size_t nelems) {
     auto n = nelems * elsize;
-    if (n == 0) {
-      n = 1;
+    if (elsize && nelems != n / elsize) {
+      return NULL;
     }
-    auto * ptr = MACWRAPPER_PREFIX(malloc) (n);
-    if (ptr) {
-      memset (ptr, 0, n);
+    if (n == 0) {
+      return xxcalloc (1, 1);
     }
-    return ptr;
+    return xxcalloc (nelems, elsize);
   }
 
   char * MACWRAPPER_PREFIX(strdup) (const char * s)
@@ -194,21 +180,7 @@ extern "C" {
       {
 	return NULL;
       }
-    // Try to just allocate an object of the requested size.
-    // If it happens to be aligned properly, just return it.
-    auto * ptr = MACWRAPPER_PREFIX(malloc)(size);
-    if (((size_t) ptr & (alignment - 1)) == (size_t) ptr) {
-      // It is already aligned just fine; return it.
-      return ptr;
-    }
-    // It was not aligned as requested: free the object.
-    MACWRAPPER_PREFIX(free)(ptr);
-    // Now get a big chunk of memory and align the object within it.
-    // NOTE: this assumes that the underlying allocator will be able
-    // to free the aligned object, or ignore the free request.
-    auto * buf = MACWRAPPER_PREFIX(malloc)(2 * alignment + size);
-    auto * alignedPtr = (void *) (((size_t) buf + alignment - 1) & ~(alignment - 1));
-    return alignedPtr;
+    return xxmemalign (alignment, size);
   }
 
   int MACWRAPPER_PREFIX(posix_memalign)(void **memptr, size_t alignment, size_t size)
@@ -271,13 +243,7 @@ extern "C" {
 						       void ** results,
 						       unsigned num_requested)
   {
-    for (unsigned i = 0; i < num_requested; i++) {
-      results[i] = MACWRAPPER_PREFIX(malloc)(sz);
-      if (results[i] == NULL) {
-	return i;
-      }
-    }
-    return num_requested;
+    return (unsigned) xxmalloc_batch (sz, num_requested, results);
   }
 
   void MACWRAPPER_PREFIX(malloc_zone_batch_free)(malloc_zone_t *,
@@ -0,0 +1,109 @@
+#ifndef MARKSTACK_H
+#define MARKSTACK_H
+
+#include <sys/mman.h>
+#include <cstring>
+
+// A marker's stack of marked objects whose contents are still to be
+// scanned, kept in anonymous mappings outside the GC heap so that marking
+// depth costs neither C stack nor heap. It doubles as needed, up to
+// MaxEntries; a push beyond that (or beyond what the kernel grants)
+// fails, and the caller must recover the dropped object some other way.
+// The owner pushes and pops at the top; other markers steal the oldest
+// entries from the bottom. Not thread-safe: callers lock it.
+class MarkStack {
+public:
+  // 64 MB of entries.
+  enum { MaxEntries = 1 << 22 };
+
+  // An object, or part of one, to scan: [start, end).
+  struct Entry {
+    char * start;
+    char * end;
+  };
+
+  MarkStack()
+    : entries (nullptr),
+      bottom (0),
+      count (0),
+      capacity (0)
+  {
+  }
+
+  bool push(char * start, char * end) {
+    if (count == capacity && !expand()) {
+      return false;
+    }
+    entries[count].start = start;
+    entries[count].end = end;
+    count++;
+    return true;
+  }
+
+  bool pop(Entry & e) {
+    if (count == bottom) {
+      return false;
+    }
+    e = entries[--count];
+    if (count == bottom) {
+      bottom = count = 0;
+    }
+    return true;
+  }
+
+  // Take the oldest entry.
+  bool steal(Entry & e) {
+    if (count == bottom) {
+      return false;
+    }
+    e = entries[bottom++];
+    if (count == bottom) {
+      bottom = count = 0;
+    }
+    return true;
+  }
+
+  size_t size() {
+    return count - bottom;
+  }
+
+  bool isEmpty() {
+    return count == bottom;
+  }
+
+private:
+
+  bool expand() {
+    if (bottom > 0 && (bottom >= capacity / 2 || capacity * 2 > MaxEntries)) {
+      // Thieves left enough room at the bottom.
+      memmove(entries, entries + bottom, (count - bottom) * sizeof(Entry));
+      count -= bottom;
+      bottom = 0;
+      return true;
+    }
+    auto newCapacity = capacity ? capacity * 2 : 4096 / sizeof(Entry);
+    if (newCapacity > MaxEntries) {
+      return false;
+    }
+    auto newEntries = (Entry *) mmap(nullptr, newCapacity * sizeof(Entry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (newEntries == (Entry *) MAP_FAILED) {
+      return false;
+    }
+    if (entries != nullptr) {
+      memcpy(newEntries, entries + bottom, (count - bottom) * sizeof(Entry));
+      count -= bottom;
+      bottom = 0;
+      munmap(entries, capacity * sizeof(Entry));
+    }
+    entries = newEntries;
+    capacity = newCapacity;
+    return true;
+  }
+
+  Entry * entries;
+  size_t bottom;          // entries[bottom, count) are live
+  size_t count;
+  size_t capacity;
+};
+
+#endif
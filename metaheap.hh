@@ -0,0 +1,60 @@
+#ifndef METAHEAP_H
+#define METAHEAP_H
+
+#include <sys/mman.h>
+#include <cstdio>
+
+// Hands out fixed-size records for allocator metadata (span descriptors
+// and the like) from anonymous mappings outside the GC heap, so they
+// never share pages with objects and are never scanned for pointers.
+// Not thread-safe: callers hold the heap lock.
+template <class T, size_t ChunkSize = 1024 * 1024>
+class MetaHeap {
+public:
+  MetaHeap()
+    : freeList (nullptr),
+      chunkPos (nullptr),
+      chunkEnd (nullptr)
+  {
+  }
+
+  T * malloc() {
+    if (freeList != nullptr) {
+      auto p = freeList;
+      freeList = freeList->next;
+      return (T *) p;
+    }
+    if (chunkPos + sizeof(T) > chunkEnd) {
+      auto p = (char *) mmap(nullptr, ChunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+      if (p == (char *) MAP_FAILED) {
+	perror("Metadata map failed");
+	return nullptr;
+      }
+      chunkPos = p;
+      chunkEnd = p + ChunkSize;
+    }
+    auto p = chunkPos;
+    chunkPos += (sizeof(T) + 15) & ~15;
+    return (T *) p;
+  }
+
+  void free(T * p) {
+    auto f = (FreeObject *) p;
+    f->next = freeList;
+    freeList = f;
+  }
+
+private:
+  static_assert(sizeof(T) <= ChunkSize, "metadata record larger than a chunk");
+
+  class FreeObject {
+  public:
+    FreeObject * next;
+  };
+
+  FreeObject * freeList;
+  char * chunkPos;
+  char * chunkEnd;
+};
+
+#endif
@@ -14,32 +14,25 @@
 #include <vector>
 #include <sstream>
 #include <cstring>
+#include <cstddef>
+#include <cerrno>
 
 #if defined(__APPLE__)
 #define _XOPEN_SOURCE 1
 #endif
 
 #include <ucontext.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dlfcn.h>
 
 #if !defined(__APPLE__)
-
-#pragma weak __data_start
-#pragma weak data_start
-
+#include <link.h>
+#include <sys/auxv.h>
+#include <sys/syscall.h>
 #endif
 
-extern "C" {
-#if !defined(__APPLE__)
-  extern int _end[];
-  extern char **__environ;
-  
-  extern char etext;
-  extern char edata;
-  extern char end;
-
-  extern int __data_start[], data_start[];
-#endif
-}
+#include "rootset.hh"
 
 extern void * GCMallocGlobal;
 
@@ -49,14 +42,57 @@ private:
   // The maximum number of global regions we will manage.
   enum { MAX_GLOBALS = 1024 };
 
-  // All ranges of globals (start, end).
+  // All ranges of globals (start, end), sorted and disjoint.
   array<pair<void *, void *>, MAX_GLOBALS> globals;
 
+  // Which of them belong to objects loaded after startup, which dlclose
+  // may unmap.
+  array<bool, MAX_GLOBALS> unloadable;
+
   // The number of global regions.
   int numGlobals;
 
+  // Ranges the program asked to have scanned as roots, and parts of the
+  // global regions it asked to have left out.
+  RootSet addedRoots;
+  RootSet excludedRoots;
+
   // True iff we have initialized everything.
   bool initialized;
+
+  // The loader's dlpi_adds and dlpi_subs as of the last refreshGlobals().
+  unsigned long long loadCount;
+  unsigned long long unloadCount;
+
+  // Objects listed by the first refreshGlobals(), and by the current one so far.
+  int startupObjects;
+  int objectCount;
+
+  // The dynamic loader's code.
+  pair<void *, void *> loaderText;
+
+  // Bytes in the global regions, and the bit of each region's first page
+  // in cleanPages.
+  size_t globalBytes;
+  array<size_t, MAX_GLOBALS> firstPage;
+
+  // One bit per page of the global regions, set if walkGlobalPages found
+  // the page to hold no pointers; that holds until its soft-dirty bit is
+  // set. Valid only while cleanPagesValid: clearing the soft-dirty bits
+  // for anything else loses the writes made since.
+  uint64_t * cleanPages;
+  size_t cleanPagesBytes;
+  bool cleanPagesValid;
+
+  // Cleared once the kernel turns out not to track soft-dirty bits.
+  bool softDirtyWorks;
+
+  // /proc/self/pagemap, opened on first use.
+  int pagemapFd;
+
+  // A page written after every clearSoftDirty() to check that the
+  // kernel tracks soft-dirty bits at all.
+  char * probePage;
   
 #if defined(__APPLE__)
   // A buffer containing the contents of vmmap's output;
@@ -66,9 +102,31 @@ private:
   
 public:
 
+#if !defined(__APPLE__)
+  // Signals that stop a thread for a collection, and let it go again.
+  enum { SuspendSignal = SIGPWR, RestartSignal = SIGXCPU };
+
+  // A thread's registers, as saved by a signal handler.
+  typedef mcontext_t Registers;
+#else
+  typedef void * Registers;
+#endif
+
   OSSpecific()
     : numGlobals (0),
-      initialized (false)     
+      initialized (false),
+      loadCount (0),
+      unloadCount (0),
+      startupObjects (0),
+      objectCount (0),
+      loaderText (nullptr, nullptr),
+      globalBytes (0),
+      cleanPages (nullptr),
+      cleanPagesBytes (0),
+      cleanPagesValid (false),
+      softDirtyWorks (true),
+      pagemapFd (-1),
+      probePage (nullptr)
   {
   }
 
@@ -82,17 +140,13 @@ public:
 #endif
     // Read in list of global regions.
 #if !defined(__APPLE__)
-    void * start, * end;
-    start = (void *) __data_start;
-    if (start == 0) {
-      start = (void *) data_start;
+    // Find the loader by its load address; a static executable has none.
+    auto base = getauxval(AT_BASE);
+    if (base != 0) {
+      dl_iterate_phdr(findLoader, this);
     }
-    end = (void *) _end;
-    if (start == 0) {
-      end = 0;
-    }
-    start = (void *) (((uintptr_t) start + 7) & ~7);
-    globals[numGlobals++]= pair<void *, void *>(start, end);
+    initialized = true;
+    refreshGlobals();
 #else
     // Need to iterate over a bunch of sections.
     // Now parse out __DATA addresses.
@@ -122,9 +176,7 @@ public:
 	  void * startptr = (void *) (((uintptr_t) start + 7) & ~7);
 	  void * endptr = (void *) end;
 	  if (end > start) {
-	    if (numGlobals < MAX_GLOBALS) {
-	      globals[numGlobals++]= pair<void *, void *>(startptr, endptr);
-	    }
+	    addGlobal(startptr, endptr, false);
 	  }
 	}
       }
@@ -133,162 +185,587 @@ public:
 	break;
       }
     }
-#endif
+    indexGlobals();
     initialized = true;
+#endif
+  }
+
+  // Rebuild the global ranges if an object has been loaded or unloaded
+  // since the last call: the writable segments of every loaded object,
+  // less the parts RELRO makes read-only. Takes the loader's lock, so
+  // call it only while no thread is stopped.
+  void refreshGlobals() {
+    if (!initialized) {
+      initialize();
+      return;
+    }
+#if !defined(__APPLE__)
+    unsigned long long counts[2] = { ~0ULL, ~0ULL };
+    dl_iterate_phdr(readCounts, counts);
+    if (counts[0] == loadCount && counts[1] == unloadCount) {
+      return;
+    }
+    numGlobals = 0;
+    objectCount = 0;
+    dl_iterate_phdr(addObject, this);
+    if (startupObjects == 0) {
+      startupObjects = objectCount;
+    }
+    // Sort by start (insertion sort: no allocation, and the objects come
+    // mostly in address order), then merge overlapping ranges. Where a
+    // permanent and an unloadable range overlap, the permanent one keeps
+    // the overlap, so that it is scanned once, and always.
+    for (int i = 1; i < numGlobals; i++) {
+      auto g = globals[i];
+      auto u = unloadable[i];
+      int j = i;
+      for (; j > 0 && globals[j - 1].first > g.first; j--) {
+	globals[j] = globals[j - 1];
+	unloadable[j] = unloadable[j - 1];
+      }
+      globals[j] = g;
+      unloadable[j] = u;
+    }
+    int n = 0;
+    for (int i = 0; i < numGlobals; i++) {
+      auto g = globals[i];
+      auto u = unloadable[i];
+      if (n > 0 && g.first <= globals[n - 1].second && u == unloadable[n - 1]) {
+	if (g.second > globals[n - 1].second) {
+	  globals[n - 1].second = g.second;
+	}
+	continue;
+      }
+      if (n > 0 && g.first < globals[n - 1].second) {
+	auto & last = globals[n - 1];
+	if (u) {
+	  // Trim this one to what follows the permanent range, and merge
+	  // it again from its new start, in its own slot.
+	  if (g.second > last.second) {
+	    g.first = last.second;
+	    int j = i;
+	    for (; j + 1 < numGlobals && globals[j + 1].first < g.first; j++) {
+	      globals[j] = globals[j + 1];
+	      unloadable[j] = unloadable[j + 1];
+	    }
+	    globals[j] = g;
+	    unloadable[j] = u;
+	    i--;
+	  }
+	  continue;
+	} else if (last.second <= g.second || numGlobals < MAX_GLOBALS) {
+	  // Trim the unloadable range to what precedes this one; any part
+	  // past it goes back in with the ranges still to merge. With no
+	  // room for that part, both stay whole.
+	  if (last.second > g.second) {
+	    insertGlobal(i + 1, pair<void *, void *>(g.second, last.second), true);
+	  }
+	  last.second = g.first;
+	  if (last.first == last.second) {
+	    n--;
+	  }
+	}
+      }
+      globals[n] = g;
+      unloadable[n] = u;
+      n++;
+    }
+    numGlobals = n;
+    indexGlobals();
+#endif
+  }
+
+  // True iff pc lies in the dynamic loader's code.
+  bool isLoaderCode(void * pc) {
+    return pc >= loaderText.first && pc < loaderText.second;
+  }
+
+  // The dynamic loader's code; empty in a static executable.
+  pair<void *, void *> getLoaderText() {
+    return loaderText;
+  }
+
+  // Scan [start, end) as a root from now on (until removeRoots), whether
+  // or not it lies in a global region. Returns false if there are too
+  // many ranges.
+  bool addRoots(void * start, void * end) {
+    return addedRoots.add(alignDown(start), alignUp(end));
+  }
+
+  // Stop scanning [start, end), or the parts of it that addRoots added.
+  bool removeRoots(void * start, void * end) {
+    return addedRoots.remove(alignDown(start), alignUp(end));
+  }
+
+  // Leave [start, end) out of the global regions for good: the words it
+  // holds are not references.
+  bool excludeRoots(void * start, void * end) {
+    return excludedRoots.add(alignUp(start), alignDown(end));
+  }
+
+  // Execute a function on the bounds of every global region, less the
+  // excluded parts, and of every added root. Those of objects dlclose
+  // may unmap meanwhile, and the added roots, which the program may
+  // remove and unmap, are included only if stopped (no other thread
+  // runs), and the former only while still mapped.
+  void walkGlobalRanges(const std::function< void(void *, void *) >& f, bool stopped) {
+    initialize();
+    for (int i = 0; i < numGlobals; i++) {
+      if (unloadable[i]) {
+	if (!stopped || !isMapped(globals[i].first, globals[i].second)) {
+	  continue;
+	}
+      }
+      excludedRoots.clip(globals[i].first, globals[i].second, f);
+    }
+    if (stopped) {
+      addedRoots.forEach(f);
+    }
+  }
+
+  // Like walkGlobalRanges, but when track is set (and the kernel keeps
+  // soft-dirty bits), pass only the pages holdsPointers finds to hold
+  // pointers, merged into runs. A call with other threads stopped skips
+  // the pages found clean by an earlier call and not written since;
+  // trackGlobalWrites() then makes the next call skip even more.
+  void walkGlobalPages(const std::function< void(void *, void *) >& f,
+		       const std::function< bool(void *, void *) >& holdsPointers,
+		       bool stopped, bool track) {
+    initialize();
+    if (!track || !stopped || !softDirtyWorks || cleanPages == nullptr) {
+      // What other threads write meanwhile is not tracked.
+      cleanPagesValid = false;
+      walkGlobalRanges(f, stopped);
+      return;
+    }
+    enum { Batch = 4096 };
+    uint64_t dirty[Batch / 64];
+    for (int i = 0; i < numGlobals; i++) {
+      auto start = (char *) globals[i].first;
+      auto end = (char *) globals[i].second;
+      auto base = (char *) ((uintptr_t) start & ~(uintptr_t) 4095);
+      auto pages = pageCount(start, end);
+      auto bit = firstPage[i];
+      if (unloadable[i] && !isMapped(start, end)) {
+	continue;
+      }
+      char * runStart = nullptr;
+      char * runEnd = nullptr;
+      for (size_t j = 0; j < pages; j++, bit++) {
+	if (j % Batch == 0 && (!cleanPagesValid ||
+			       !readSoftDirty(base + j * 4096, std::min((size_t) Batch, pages - j), dirty))) {
+	  memset(dirty, 0xff, sizeof(dirty));
+	}
+	auto pageStart = std::max(base + j * 4096, start);
+	auto pageEnd = std::min(base + (j + 1) * 4096, end);
+	auto written = (dirty[(j % Batch) / 64] >> (j % 64)) & 1;
+	auto clean = (cleanPages[bit / 64] >> (bit % 64)) & 1;
+	if (!written && clean) {
+	  continue;
+	}
+	auto pointers = false;
+	excludedRoots.clip(pageStart, pageEnd, [&](char * s, char * e) {
+	    pointers = pointers || holdsPointers(s, e);
+	  });
+	if (!pointers) {
+	  cleanPages[bit / 64] |= 1ULL << (bit % 64);
+	  continue;
+	}
+	cleanPages[bit / 64] &= ~(1ULL << (bit % 64));
+	excludedRoots.clip(pageStart, pageEnd, [&](char * s, char * e) {
+	    if (s != runEnd) {
+	      if (runStart != nullptr) {
+		f(runStart, runEnd);
+	      }
+	      runStart = s;
+	    }
+	    runEnd = e;
+	  });
+      }
+      if (runStart != nullptr) {
+	f(runStart, runEnd);
+      }
+    }
+    addedRoots.forEach(f);
+    cleanPagesValid = true;
   }
 
-  // Execute a function on every word in the registers.
-  void walkRegisters(const std::function< void(void *) >& f) {
+  // Clear the soft-dirty bits right after a walkGlobalPages, while no
+  // other thread can write a global, so that from the next call on only
+  // pages written after this one are checked again.
+  void trackGlobalWrites() {
+    if (!clearRefs()) {
+      softDirtyWorks = false;
+      cleanPagesValid = false;
+    }
+  }
+
+  // The total size of the global regions.
+  size_t globalSize() {
+    return globalBytes;
+  }
+
+  // Execute a function on the bounds of each of the calling thread's
+  // TLS blocks that has been allocated. Takes the loader's lock.
+  static void walkThreadTLS(const std::function< void(void *, void *) >& f) {
+#if !defined(__APPLE__)
+    dl_iterate_phdr([](struct dl_phdr_info * info, size_t size, void * data) -> int {
+	if (size < offsetof(struct dl_phdr_info, dlpi_tls_data) + sizeof(info->dlpi_tls_data) ||
+	    info->dlpi_tls_data == nullptr) {
+	  return 0;
+	}
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+	  auto & ph = info->dlpi_phdr[i];
+	  if (ph.p_type == PT_TLS) {
+	    auto start = (char *) info->dlpi_tls_data;
+	    (*(const std::function< void(void *, void *) > *) data)(start, start + ph.p_memsz);
+	  }
+	}
+	return 0;
+      }, (void *) &f);
+#endif
+  }
+
+  // Spill the calling thread's registers into r, where they can be
+  // scanned like memory.
+  static void getRegisters(Registers & r) {
 #if defined(__APPLE__)
     // Give up. getcontext just doesn't work in this context :(.
+    r = nullptr;
 #else // linux
     ucontext_t ucp;
     getcontext(&ucp);
-    void * bufStart;
-    size_t bufSize;
-    bufStart = &ucp.uc_mcontext.gregs;
-    bufSize = sizeof(ucp.uc_mcontext.gregs);
-    const auto startVal = (uintptr_t) bufStart; // + sizeof(void*) - 1) & ~(sizeof(void *) - 1);
-    const auto endVal   = (uintptr_t) bufStart + bufSize;
-    for (auto ptr = startVal; ptr < endVal; ptr += sizeof(void *)) {
-      void ** p = (void **) ptr;
-      f((void *) *p);
+    memcpy(&r, &ucp.uc_mcontext, sizeof(r));
+#endif
+  }
+
+  // Get the bounds of the calling thread's stack. May allocate.
+  static bool getThreadStack(void *& start, void *& end) {
+#if !defined(__APPLE__)
+    pthread_attr_t attr;
+    void * addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+      return false;
     }
+    auto ok = pthread_attr_getstack(&attr, &addr, &size) == 0;
+    pthread_attr_destroy(&attr);
+    if (!ok) {
+      return false;
+    }
+    start = addr;
+    end = (char *) addr + size;
+#else
+    auto self = pthread_self();
+    end = pthread_get_stackaddr_np(self);
+    start = (char *) end - pthread_get_stacksize_np(self);
 #endif
+    return true;
   }
-  
-  // Execute a function on every word on the stack.
-  void walkStack(const std::function< void(void *) >& f) {
-    void * start, * end;
-    getStack(start, end);
-    const auto startVal = (uintptr_t) start;
-    const auto endVal   = (((uintptr_t) end + 4095) & ~4095) - 1; // Round up to next page.
-    for (auto ptr = startVal; ptr < endVal; ptr += sizeof(void *)) {
-      void ** p = (void **) ptr;
-      f((void *) *p);
+
+  // Start a thread with the C library's pthread_create, bypassing the
+  // allocator's own (see gnuwrapper.cpp).
+  static int createThread(pthread_t * thread, const pthread_attr_t * attr,
+			  void *(*start)(void *), void * arg) {
+    typedef int (*CreateFunction)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *);
+    static auto create = (CreateFunction) dlsym(RTLD_NEXT, "pthread_create");
+    if (create == nullptr) {
+      return pthread_create(thread, attr, start, arg);
     }
+    return create(thread, attr, start, arg);
   }
 
-  // Execute a function on every word in the global space.
-  void walkGlobals(const std::function< void(void *) >& f) {
-    initialize();
-    for (int i = 0; i < numGlobals; i++) {
-      const auto start = (uintptr_t) globals[i].first;
-      const auto end   = (uintptr_t) globals[i].second;
-      for (auto ptr = start; ptr < end; ptr += sizeof(void *)) {
-	void ** p = (void **) ptr;
-	f((void *) *p);
+#if !defined(__APPLE__)
+  // Change the calling thread's signal mask with the C library's
+  // pthread_sigmask (or sigprocmask), bypassing the allocator's own (see
+  // gnuwrapper.cpp), but never block the signals that stop and restart
+  // the thread for a collection: a thread blocking them would stall
+  // every collection.
+  static int setSignalMask(int how, const sigset_t * set, sigset_t * old, bool process) {
+    typedef int (*MaskFunction)(int, const sigset_t *, sigset_t *);
+    static auto threadMask = (MaskFunction) dlsym(RTLD_NEXT, "pthread_sigmask");
+    static auto processMask = (MaskFunction) dlsym(RTLD_NEXT, "sigprocmask");
+    sigset_t allowed;
+    if (set != nullptr && how != SIG_UNBLOCK) {
+      allowed = *set;
+      sigdelset(&allowed, SuspendSignal);
+      sigdelset(&allowed, RestartSignal);
+      set = &allowed;
+    }
+    auto mask = process ? processMask : threadMask;
+    if (mask != nullptr) {
+      return mask(how, set, old);
+    }
+    if (syscall(SYS_rt_sigprocmask, how, set, old, _NSIG / 8) != 0) {
+      return process ? -1 : errno;
+    }
+    return 0;
+  }
+#endif
+
+  // Copy the registers of an interrupted thread out of the context
+  // passed to its signal handler.
+  static void saveRegisters(void * context, Registers & r) {
+#if !defined(__APPLE__)
+    memcpy(&r, &((ucontext_t *) context)->uc_mcontext, sizeof(r));
+#else
+    r = nullptr;
+#endif
+  }
+
+  // Start tracking which pages get written, by clearing every page's
+  // soft-dirty bit. Returns false if the kernel does not track them.
+  bool clearSoftDirty() {
+    // The clean global pages written since they were found are lost.
+    cleanPagesValid = false;
+    if (!clearRefs()) {
+      softDirtyWorks = false;
+      return false;
+    }
+    return true;
+  }
+
+  // Set bit i of bits iff page i from start (page-aligned) has been
+  // written since the last clearSoftDirty(). Returns false on failure.
+  bool readSoftDirty(void * start, size_t pages, uint64_t * bits) {
+#if defined(__linux__)
+    if (pagemapFd < 0) {
+      pagemapFd = open("/proc/self/pagemap", O_RDONLY);
+      if (pagemapFd < 0) {
+	return false;
+      }
+    }
+    enum { SoftDirtyBit = 55, Batch = 512 };
+    uint64_t entries[Batch];
+    auto page = (uintptr_t) start / 4096;
+    memset(bits, 0, (pages + 63) / 64 * sizeof(uint64_t));
+    for (size_t i = 0; i < pages; i += Batch) {
+      auto n = (pages - i < Batch) ? pages - i : (size_t) Batch;
+      auto sz = n * sizeof(uint64_t);
+      if (::pread(pagemapFd, entries, sz, (page + i) * sizeof(uint64_t)) != (ssize_t) sz) {
+	return false;
+      }
+      for (size_t j = 0; j < n; j++) {
+	bits[(i + j) / 64] |= ((entries[j] >> SoftDirtyBit) & 1) << ((i + j) % 64);
       }
     }
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // The number of processors this process may run on at once: those in
+  // its affinity mask, capped by its cgroup's CPU quota (if any).
+  static int availableProcessors() {
+#if !defined(__APPLE__)
+    int cpus = 1;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      cpus = CPU_COUNT(&set);
+    }
+    long quota = 0, period = 0;
+    char buf[64];
+    // cgroup v2: "<quota> <period>", or "max <period>" when unlimited.
+    if (readFile("/sys/fs/cgroup/cpu.max", buf, sizeof(buf))) {
+      sscanf(buf, "%ld %ld", &quota, &period);
+    } else if (readFile("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", buf, sizeof(buf))) {
+      // cgroup v1: a quota of -1 means unlimited.
+      quota = strtol(buf, nullptr, 10);
+      if (readFile("/sys/fs/cgroup/cpu/cpu.cfs_period_us", buf, sizeof(buf))) {
+	period = strtol(buf, nullptr, 10);
+      }
+    }
+    if (quota > 0 && period > 0) {
+      auto limit = (int) ((quota + period - 1) / period);
+      if (limit < cpus) {
+	cpus = limit;
+      }
+    }
+    return (cpus > 0) ? cpus : 1;
+#else
+    return (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
   }
 
 private:
 
-  // Get the range of the stack.
-  static void getStack(void *& start, void *& end) {
+  void addGlobal(void * start, void * end, bool canUnload) {
+    if (numGlobals < MAX_GLOBALS) {
+      globals[numGlobals] = pair<void *, void *>(start, end);
+      unloadable[numGlobals] = canUnload;
+      numGlobals++;
+    }
+  }
+
+  // Insert a range among globals[from, numGlobals), which are sorted by
+  // start, keeping them so. Call only with room for it.
+  void insertGlobal(int from, pair<void *, void *> g, bool canUnload) {
+    int j = numGlobals;
+    for (; j > from && globals[j - 1].first > g.first; j--) {
+      globals[j] = globals[j - 1];
+      unloadable[j] = unloadable[j - 1];
+    }
+    globals[j] = g;
+    unloadable[j] = canUnload;
+    numGlobals++;
+  }
+
+  static void * alignDown(void * p) {
+    return (void *) ((uintptr_t) p & ~(uintptr_t) (sizeof(void *) - 1));
+  }
+
+  static void * alignUp(void * p) {
+    return alignDown((char *) p + sizeof(void *) - 1);
+  }
+
+  // The number of pages [start, end) touches.
+  static size_t pageCount(void * start, void * end) {
+    auto first = (uintptr_t) start & ~(uintptr_t) 4095;
+    return ((uintptr_t) end - first + 4095) / 4096;
+  }
+
+  // Number the pages of the global regions, forgetting which were clean.
+  void indexGlobals() {
+    size_t pages = 0;
+    globalBytes = 0;
+    for (int i = 0; i < numGlobals; i++) {
+      firstPage[i] = pages;
+      pages += pageCount(globals[i].first, globals[i].second);
+      globalBytes += (char *) globals[i].second - (char *) globals[i].first;
+    }
+    auto bytes = (pages + 63) / 64 * sizeof(uint64_t);
+    if (bytes > cleanPagesBytes) {
+      if (cleanPages != nullptr) {
+	munmap(cleanPages, cleanPagesBytes);
+      }
+      auto p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+      cleanPages = (p == MAP_FAILED) ? nullptr : (uint64_t *) p;
+      cleanPagesBytes = (p == MAP_FAILED) ? 0 : bytes;
+    } else if (cleanPages != nullptr) {
+      memset(cleanPages, 0, cleanPagesBytes);
+    }
+  }
+
+  // True iff every page of [start, end) is mapped.
+  static bool isMapped(void * start, void * end) {
+    auto page = (uintptr_t) start & ~(uintptr_t) 4095;
+    return msync((void *) page, (uintptr_t) end - page, MS_ASYNC) == 0;
+  }
+
 #if !defined(__APPLE__)
-    unsigned long kstkesp, startstack;
-    readStat(kstkesp, startstack);
-    start = (void *) kstkesp;
-    end   = (void *) startstack;
+  static int findLoader(struct dl_phdr_info * info, size_t, void * data) {
+    auto self = (OSSpecific *) data;
+    if (info->dlpi_addr != getauxval(AT_BASE)) {
+      return 0;
+    }
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+      auto & ph = info->dlpi_phdr[i];
+      if (ph.p_type == PT_LOAD && (ph.p_flags & PF_X)) {
+	auto start = (char *) info->dlpi_addr + ph.p_vaddr;
+	if (self->loaderText.first == nullptr || start < self->loaderText.first) {
+	  self->loaderText.first = start;
+	}
+	if (start + ph.p_memsz > self->loaderText.second) {
+	  self->loaderText.second = start + ph.p_memsz;
+	}
+      }
+    }
+    return 1;
+  }
+
+  // Read dlpi_adds and dlpi_subs (once: they are the same for every object).
+  static int readCounts(struct dl_phdr_info * info, size_t size, void * data) {
+    auto counts = (unsigned long long *) data;
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+      counts[0] = info->dlpi_adds;
+      counts[1] = info->dlpi_subs;
+    }
+    return 1;
+  }
+
+  static int addObject(struct dl_phdr_info * info, size_t size, void * data) {
+    auto self = (OSSpecific *) data;
+    auto canUnload = self->startupObjects != 0 && self->objectCount >= self->startupObjects;
+    self->objectCount++;
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+      self->loadCount = info->dlpi_adds;
+      self->unloadCount = info->dlpi_subs;
+    }
+    // The loader makes the RELRO pages (rounded down) read-only after relocation.
+    uintptr_t relroStart = 0, relroEnd = 0;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+      auto & ph = info->dlpi_phdr[i];
+      if (ph.p_type == PT_GNU_RELRO) {
+	relroStart = (info->dlpi_addr + ph.p_vaddr) & ~(uintptr_t) 4095;
+	relroEnd = (info->dlpi_addr + ph.p_vaddr + ph.p_memsz) & ~(uintptr_t) 4095;
+      }
+    }
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+      auto & ph = info->dlpi_phdr[i];
+      if (ph.p_type != PT_LOAD || !(ph.p_flags & PF_W)) {
+	continue;
+      }
+      uintptr_t start = (info->dlpi_addr + ph.p_vaddr + 7) & ~(uintptr_t) 7;
+      uintptr_t end = info->dlpi_addr + ph.p_vaddr + ph.p_memsz;
+      if (relroStart < relroEnd && relroStart < end && relroEnd > start) {
+	if (start < relroStart) {
+	  self->addGlobal((void *) start, (void *) relroStart, canUnload);
+	}
+	start = relroEnd;
+      }
+      if (start < end) {
+	self->addGlobal((void *) start, (void *) end, canUnload);
+      }
+    }
+    return 0;
+  }
+#endif
+
+  // Clear every page's soft-dirty bit, then check with a write to
+  // probePage that the kernel sets them again.
+  bool clearRefs() {
+#if defined(__linux__)
+    if (probePage == nullptr) {
+      auto p = mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+      if (p == MAP_FAILED) {
+	return false;
+      }
+      probePage = (char *) p;
+    }
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0) {
+      return false;
+    }
+    auto ok = write(fd, "4", 1) == 1;
+    close(fd);
+    if (!ok) {
+      return false;
+    }
+    *(volatile char *) probePage = 1;
+    uint64_t probe;
+    return readSoftDirty(probePage, 1, &probe) && probe == 1;
 #else
-    static pthread_t self = pthread_self();
-    auto addr = pthread_get_stackaddr_np(self);
-    auto size = pthread_get_stacksize_np(self);
-    // Assumes stack grows down.
-    start = (void *) ((uintptr_t) addr - size);
-    end = addr;
+    return false;
 #endif
-    start = (void *) (((uintptr_t) start + 7) & ~7);
   }
 
-  // Parse every value out of stat, but keep only the stack pointer and start of the stack.
-  static void readStat(unsigned long& kstkesp, unsigned long& startstack)
-  {
-    int fd = open("/proc/self/stat", O_RDONLY);
-    char buf[4096];
-    size_t sz = read(fd, buf, 4096);
-    //  void * addr = mmap(0, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
-    int pid;
-    char comm[255];
-    char state;
-    int ppid;
-    int pgrp;
-    int session;
-    int tty_nr;
-    int tpgid;
-    unsigned flags;
-    unsigned long minflt, cminflt, majflt, cmajflt, utime, stime;
-    long cutime, cstime, priority, nice, num_threads, itrealvalue;
-    unsigned long long starttime;
-    unsigned long vsize;
-    long rss;
-    unsigned long rsslim, startcode, endcode;
-    /*    unsigned long startstack; */
-    /*    unsigned long kstkesp; */
-    unsigned long kstkeip, signal, blocked, sigignore, sigcatch, wchan, nswap, cnswap;
-    int exit_signal, processor;
-    unsigned int rt_priority, policy;
-    unsigned long long delayacct_blkio_ticks;
-    unsigned long guest_time;
-    long cguest_time;
-    unsigned long start_data, end_data, start_brk, arg_start, arg_end, env_start, env_end;
-    int exit_code;
-    sscanf((char *) buf, "%d %s %c %d %d %d %d %d %u %lu %lu %lu %lu %lu %lu %ld %ld %ld %ld %ld %ld %llu %lu %ld %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %d %d %u %u %llu %lu %ld %lu %lu %lu %lu %lu %lu %lu %d",
-	   &pid,
-	   (char *) &comm,
-	   &state,
-	   &ppid,
-	   &pgrp,
-	   &session,
-	   &tty_nr,
-	   &tpgid,
-	   &flags,
-	   &minflt,
-	   &cminflt,
-	   &majflt,
-	   &cmajflt,
-	   &utime,
-	   &stime,
-	   &cutime,
-	   &cstime,
-	   &priority,
-	   &nice,
-	   &num_threads,
-	   &itrealvalue,
-	   &starttime,
-	   &vsize,
-	   &rss,
-	   &rsslim,
-	   &startcode,
-	   &endcode,
-	   &startstack,
-	   &kstkesp,
-	   &kstkeip,
-	   &signal,
-	   &blocked,
-	   &sigignore,
-	   &sigcatch,
-	   &wchan,
-	   &nswap,
-	   &cnswap,
-	   &exit_signal,
-	   &processor,
-	   &rt_priority,
-	   &policy,
-	   &delayacct_blkio_ticks,
-	   &guest_time,
-	   &cguest_time,
-	   &start_data,
-	   &end_data,
-	   &start_brk,
-	   &arg_start,
-	   &arg_end,
-	   &env_start,
-	   &env_end,
-	   &exit_code);
+
+  // Read a small file into buf (NUL-terminated) without allocating.
+  static bool readFile(const char * name, char * buf, size_t len) {
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    auto sz = read(fd, buf, len - 1);
+    close(fd);
+    if (sz <= 0) {
+      return false;
+    }
+    buf[sz] = '\0';
+    return true;
   }
-  
+
   int pread(int pid, char * buf, int buflen) {
     // Build up the command.
     // Nasty hackery here to redirect vmmap into a temporary file.
@@ -0,0 +1,699 @@
+#ifndef PAGEHEAP_H
+#define PAGEHEAP_H
+
+#include <sys/mman.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+
+#include "metaheap.hh"
+
+// A run of contiguous, page-aligned memory, as recorded in the page map.
+// The descriptor always lives outside the run itself.
+class PageRun {
+public:
+  // Granularity of the page map.
+  enum { PageShift = 12, PageSize = 1 << PageShift };
+
+  enum Kind {
+    FreeRun,   // unused pages owned by the page heap
+    SmallRun,  // a Span of small objects
+    LargeRun,  // one large object carved from the page heap
+    HugeRun    // one huge object in its own mapping (not in the page map)
+  };
+
+  char * end() {
+    return start + (pages << PageShift);
+  }
+  bool contains(void * p) {
+    return (char *) p >= start && (char *) p < end();
+  }
+
+  char * start;
+  size_t pages;
+  Kind kind;
+  // Links in whichever list the run's owner keeps it on.
+  PageRun * prev;
+  PageRun * next;
+  // Free runs only: when the run was freed (ms), and whether it has
+  // since been purged (as far as the purge unit allows).
+  uint64_t freedAt;
+  bool purged;
+};
+
+// Best-fit allocator of page runs carved from the regions of a source
+// heap. Freed runs are coalesced with free neighbours in the same region
+// through the region's page map, which records runs in use on every
+// page, so any address resolves to its run in constant time, and free
+// runs on their first and last pages only. Regions are found from an
+// address by a flat table indexed by the address's region number.
+// Callers hold the heap lock.
+template <class SourceHeap>
+class PageHeap {
+public:
+  // Free runs up to this many pages are kept in exact-size bins.
+  enum { MaxBinPages = 256 };
+
+  // Runs at least this big are cleared by purging rather than memset.
+  enum { ZeroByPurgeBytes = 256 * 1024 };
+
+  enum {
+    RegionShift = SourceHeap::RegionShift,
+    RegionPages = 1 << (RegionShift - PageRun::PageShift),
+    // One mark bit per granule: the minimum object alignment.
+    MarkGranuleShift = 4,
+    MarkWords = 1 << (RegionShift - MarkGranuleShift - 6),
+    // User addresses fit in 48 bits.
+    MapEntries = 1 << (48 - RegionShift)
+  };
+
+  PageHeap()
+    : source (nullptr),
+      regionMap (nullptr),
+      current (nullptr),
+      regions (nullptr),
+      freePages (0),
+      largeFree (nullptr)
+  {
+    for (auto& b : bins) {
+      b = nullptr;
+    }
+  }
+
+  bool initialize(SourceHeap * src) {
+    source = src;
+    // Mapped lazily by the kernel: only entries for live regions are touched.
+    regionMap = (Region **) mmap(nullptr, MapEntries * sizeof(Region *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (regionMap == (Region **) MAP_FAILED) {
+      perror("Region map failed");
+      regionMap = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  // True iff p lies in pages this heap has handed out (or holds free).
+  bool contains(void * p) {
+    auto r = regionOf(p);
+    return r != nullptr && (char *) p < r->end;
+  }
+
+  // Pages sitting in free runs.
+  size_t getFreePages() { return freePages; }
+
+  // Give the pages of free runs that have stayed free for at least
+  // minAge ms back to the OS; they read as zero when next touched.
+  // Only whole units of the source's purge size are released, so a run
+  // narrower than a huge page stays resident. Returns the bytes purged.
+  size_t purge(uint64_t minAge) {
+    auto now = currentTime();
+    auto unit = source->getPurgeSize();
+    size_t purgedBytes = 0;
+    for (size_t b = 1; b <= MaxBinPages + 1; b++) {
+      auto list = (b <= MaxBinPages) ? bins[b] : largeFree;
+      for (auto run = list; run != nullptr; run = run->next) {
+	if (run->purged || now - run->freedAt < minAge) {
+	  continue;
+	}
+	auto lo = (char *) (((uintptr_t) run->start + unit - 1) & ~(unit - 1));
+	auto hi = (char *) ((uintptr_t) run->end() & ~(unit - 1));
+	if (lo < hi) {
+	  madvise(lo, hi - lo, MADV_DONTNEED);
+	  purgedBytes += hi - lo;
+	}
+	run->purged = true;
+      }
+    }
+    return purgedBytes;
+  }
+
+  // Bytes that can still be added to the heap without reusing free runs.
+  size_t getRemaining() {
+    auto rest = source->getRemaining();
+    if (current != nullptr) {
+      rest += current->start + RegionSize - current->end;
+    }
+    return rest;
+  }
+
+  // The run recorded for the page holding p; NULL outside the heap, in
+  // pages never handed out and in the interior pages of free runs.
+  PageRun * lookup(void * p) {
+    auto r = regionOf(p);
+    return r != nullptr ? r->pageMap[pageIndex(r, p)] : nullptr;
+  }
+
+  // The run holding p, or NULL. Only the first and last pages of a free
+  // run find it.
+  PageRun * find(void * p) {
+    auto run = lookup(p);
+    return (run != nullptr && run->contains(p)) ? run : nullptr;
+  }
+
+  // Mark bits live in a dense bitmap beside each region's page map, so
+  // that marking never writes to (or copies on write) the heap's pages.
+  // The heap decides what a bit's value means.
+  bool getMark(void * p) {
+    size_t i;
+    auto r = markIndex(p, i);
+    return (r->markBits[i / 64] >> (i % 64)) & 1;
+  }
+
+  // Bits are set atomically: markers may be setting their neighbours.
+  void setMark(void * p, bool value) {
+    size_t i;
+    auto r = markIndex(p, i);
+    setBits(&r->markBits[i / 64], 1UL << (i % 64), value);
+  }
+
+  // Set p's mark bit to value, atomically against other markers.
+  // Returns false if it held value already.
+  bool trySetMark(void * p, bool value) {
+    size_t i;
+    auto r = markIndex(p, i);
+    auto word = &r->markBits[i / 64];
+    auto bit = 1UL << (i % 64);
+    if (((__atomic_load_n(word, __ATOMIC_RELAXED) & bit) != 0) == value) {
+      return false;
+    }
+    auto old = value ? __atomic_fetch_or(word, bit, __ATOMIC_RELAXED) : __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+    return ((old & bit) != 0) != value;
+  }
+
+  // The mark bits of n (at most 64) objects stride bytes apart from p,
+  // the first in bit 0. Runs never cross regions.
+  uint64_t getMarks(char * p, size_t stride, unsigned n) {
+    size_t i;
+    auto r = markIndex(p, i);
+    auto mask = (n == 64) ? ~0UL : (1UL << n) - 1;
+    if (stride == (1 << MarkGranuleShift) && i % 64 == 0) {
+      return r->markBits[i / 64] & mask;
+    }
+    uint64_t bits = 0;
+    auto step = stride >> MarkGranuleShift;
+    for (unsigned k = 0; k < n; k++, i += step) {
+      bits |= ((r->markBits[i / 64] >> (i % 64)) & 1) << k;
+    }
+    return bits;
+  }
+
+  // Refresh each region's record of the pages written since soft-dirty
+  // tracking last started, through read(start, pages, bits), which sets
+  // bit i of bits iff page i was written. Where read fails, every page
+  // counts as written.
+  template <class Reader>
+  void loadDirtyPages(Reader read) {
+    for (auto r = regions; r != nullptr; r = r->nextRegion) {
+      auto pages = (size_t) (r->end - r->start) >> PageRun::PageShift;
+      if (!read(r->start, pages, r->dirtyBits)) {
+	memset(r->dirtyBits, 0xff, sizeof(r->dirtyBits));
+      }
+    }
+  }
+
+  // Was the page holding p written, as of the last loadDirtyPages()?
+  bool isDirty(void * p) {
+    auto r = regionOf(p);
+    auto i = pageIndex(r, p);
+    return (r->dirtyBits[i / 64] >> (i % 64)) & 1;
+  }
+
+  // Start loading the page map entry and mark bits for p, if it is in
+  // the heap, ahead of a lookup.
+  void prefetch(void * p) {
+    auto r = regionOf(p);
+    if (r != nullptr) {
+      auto offset = (size_t) ((char *) p - r->start);
+      __builtin_prefetch(&r->pageMap[offset >> PageRun::PageShift]);
+      __builtin_prefetch(&r->markBits[(offset >> MarkGranuleShift) / 64]);
+    }
+  }
+
+  // Set the mark bits of n objects stride bytes apart from p.
+  void setMarks(char * p, size_t stride, size_t n, bool value) {
+    size_t i;
+    auto r = markIndex(p, i);
+    auto step = stride >> MarkGranuleShift;
+    if (step == 1) {
+      // Densely packed: a word at a time.
+      while (n) {
+	auto bit = i % 64;
+	auto len = (n < 64 - bit) ? n : 64 - bit;
+	auto bits = (len == 64) ? ~0UL : ((1UL << len) - 1) << bit;
+	setBits(&r->markBits[i / 64], bits, value);
+	i += len;
+	n -= len;
+      }
+      return;
+    }
+    for (; n; n--, i += step) {
+      setBits(&r->markBits[i / 64], 1UL << (i % 64), value);
+    }
+  }
+
+  // Point the page map at a run: every page (for runs in use), or just
+  // its first and last (for free runs).
+  // Markers read the page map without the lock. While they run, it only
+  // grows: the heap records new runs but never clears or repoints the
+  // entries of a run in use (it refuses resizes, and the sweep, which
+  // alone frees runs, waits for the mark to end), so clear() only meets
+  // pages no object holds.
+  void record(PageRun * run, bool allPages) {
+    auto r = regionOf(run->start);
+    auto first = pageIndex(r, run->start);
+    if (allPages) {
+      for (size_t i = 0; i < run->pages; i++) {
+	r->pageMap[first + i] = run;
+      }
+    } else {
+      r->pageMap[first] = run;
+      r->pageMap[first + run->pages - 1] = run;
+    }
+  }
+
+  // Return the start of a run of the given number of pages, or NULL.
+  // The caller records its own descriptor for the run. If zeroed is
+  // given, it is set to whether the pages are known to read as zero
+  // (never used, or purged since they were).
+  char * allocate(size_t pages, bool * zeroed = nullptr) {
+    if (pages > RegionPages) {
+      return nullptr;
+    }
+    auto run = findBestFit(pages);
+    if (run == nullptr) {
+      return grow(pages, zeroed);
+    }
+    removeFree(run);
+    auto p = run->start;
+    if (zeroed != nullptr) {
+      // Purging in huge page units may have left the edges of the run.
+      *zeroed = run->purged && source->getPurgeSize() == PageRun::PageSize;
+    }
+    if (run->pages > pages) {
+      // Split: the tail stays free.
+      run->start += pages << PageRun::PageShift;
+      run->pages -= pages;
+      insertFree(run);
+    } else {
+      freeMeta.free(run);
+    }
+    return p;
+  }
+
+  // Clear pages that may hold old data: small runs with memset, big ones
+  // by purging their whole purge units (the kernel zero-fills them on
+  // the next touch) and memset of the edges.
+  void zero(char * p, size_t pages) {
+    auto bytes = pages << PageRun::PageShift;
+    auto unit = source->getPurgeSize();
+    auto lo = (char *) (((uintptr_t) p + unit - 1) & ~(unit - 1));
+    auto hi = (char *) ((uintptr_t) (p + bytes) & ~(unit - 1));
+    if (bytes < ZeroByPurgeBytes || lo >= hi) {
+      memset(p, 0, bytes);
+      return;
+    }
+    memset(p, 0, lo - p);
+    madvise(lo, hi - lo, MADV_DONTNEED);
+    memset(hi, 0, p + bytes - hi);
+  }
+
+  // Resize a run in use, keeping its start.
+  // Shrinking frees the tail. Growing takes pages from a free run right
+  // after it, or from the unused end of the current region; it returns
+  // false if they are not there.
+  bool resize(PageRun * run, size_t pages) {
+    auto r = regionOf(run->start);
+    auto oldPages = run->pages;
+    if (pages < oldPages) {
+      run->pages = pages;
+      release(run->end(), oldPages - pages);
+      return true;
+    }
+    auto extra = pages - oldPages;
+    auto next = run->end();
+    if (next == r->end) {
+      if (r != current || next + (extra << PageRun::PageShift) > r->start + RegionSize) {
+	return false;
+      }
+      r->end += extra << PageRun::PageShift;
+    } else {
+      auto after = r->pageMap[pageIndex(r, next)];
+      if (after == nullptr || after->kind != PageRun::FreeRun || after->pages < extra) {
+	return false;
+      }
+      removeFree(after);
+      clear(r, after->start, after->pages);
+      if (after->pages > extra) {
+	after->start += extra << PageRun::PageShift;
+	after->pages -= extra;
+	insertFree(after);
+      } else {
+	freeMeta.free(after);
+      }
+    }
+    run->pages = pages;
+    record(run, true);
+    return true;
+  }
+
+  // Give a run back, coalescing it with free neighbours.
+  void release(char * p, size_t pages) {
+    auto r = regionOf(p);
+    clear(r, p, pages);
+    auto run = freeMeta.malloc();
+    if (run == nullptr) {
+      // Out of metadata: the pages are leaked, but never handed out twice.
+      return;
+    }
+    run->kind = PageRun::FreeRun;
+    run->start = p;
+    run->pages = pages;
+    // The merged run is as old, and as purged, as its newest part.
+    run->freedAt = currentTime();
+    run->purged = false;
+    if (p > r->start) {
+      auto before = r->pageMap[pageIndex(r, p) - 1];
+      if (before != nullptr && before->kind == PageRun::FreeRun) {
+	removeFree(before);
+	clear(r, before->start, before->pages);
+	run->start = before->start;
+	run->pages += before->pages;
+	freeMeta.free(before);
+      }
+    }
+    if (run->end() < r->end) {
+      auto after = r->pageMap[pageIndex(r, run->end())];
+      if (after != nullptr && after->kind == PageRun::FreeRun) {
+	removeFree(after);
+	clear(r, after->start, after->pages);
+	run->pages += after->pages;
+	freeMeta.free(after);
+      }
+    }
+    insertFree(run);
+  }
+
+private:
+
+  static constexpr size_t RegionSize = (size_t) 1 << RegionShift;
+
+  // One region of the source heap, with the page map, mark bitmap and
+  // written pages covering it. Lives outside the heap.
+  struct Region {
+    char * start;
+    char * end;               // pages handed out so far: [start, end)
+    Region * nextRegion;
+    PageRun * pageMap[RegionPages];
+    uint64_t markBits[MarkWords];
+    uint64_t dirtyBits[RegionPages / 64];
+  };
+
+  // Monotonic time in ms; coarse is plenty for purge decay.
+  static uint64_t currentTime() {
+    struct timespec ts;
+#if defined(CLOCK_MONOTONIC_COARSE)
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
+
+  Region * regionOf(void * p) {
+    auto i = (uintptr_t) p >> RegionShift;
+    return (i < MapEntries) ? regionMap[i] : nullptr;
+  }
+
+  size_t pageIndex(Region * r, void * p) {
+    return (size_t) ((char *) p - r->start) >> PageRun::PageShift;
+  }
+
+  static void setBits(uint64_t * word, uint64_t bits, bool value) {
+    if (value) {
+      __atomic_fetch_or(word, bits, __ATOMIC_RELAXED);
+    } else {
+      __atomic_fetch_and(word, ~bits, __ATOMIC_RELAXED);
+    }
+  }
+
+  Region * markIndex(void * p, size_t & i) {
+    auto r = regionOf(p);
+    i = (size_t) ((char *) p - r->start) >> MarkGranuleShift;
+    return r;
+  }
+
+  // Forget the page map entries of a run that is being merged or reused.
+  void clear(Region * r, char * p, size_t pages) {
+    memset(&r->pageMap[pageIndex(r, p)], 0, pages * sizeof(PageRun *));
+  }
+
+  PageRun * findBestFit(size_t pages) {
+    for (size_t b = pages; b <= MaxBinPages; b++) {
+      if (bins[b] != nullptr) {
+	return bins[b];
+      }
+    }
+    PageRun * best = nullptr;
+    for (auto run = largeFree; run != nullptr; run = run->next) {
+      if (run->pages >= pages && (best == nullptr || run->pages < best->pages)) {
+	best = run;
+      }
+    }
+    return best;
+  }
+
+  // Extend the current region, reusing a free run at its end; when it is
+  // full, retire its unused tail to the free lists and start a new region.
+  char * grow(size_t pages, bool * zeroed) {
+    auto bytes = pages << PageRun::PageShift;
+    if (current != nullptr && current->end + bytes > current->start + RegionSize) {
+      auto tail = current->end;
+      auto tailPages = (size_t) (current->start + RegionSize - tail) >> PageRun::PageShift;
+      current->end = current->start + RegionSize;
+      if (tailPages > 0) {
+	release(tail, tailPages);
+	// Coalesced with a free run before it, the tail may now be enough.
+	if (findBestFit(pages) != nullptr) {
+	  return allocate(pages, zeroed);
+	}
+      }
+      current = nullptr;
+    }
+    if (current == nullptr && !newRegion()) {
+      return nullptr;
+    }
+
+    // Pages past the end of the region were never touched.
+    auto p = current->end;
+    auto fresh = true;
+    if (p > current->start) {
+      auto tail = current->pageMap[pageIndex(current, p) - 1];
+      if (tail != nullptr && tail->kind == PageRun::FreeRun) {
+	fresh = tail->purged && source->getPurgeSize() == PageRun::PageSize;
+	removeFree(tail);
+	clear(current, tail->start, tail->pages);
+	p = tail->start;
+	freeMeta.free(tail);
+      }
+    }
+    current->end = p + bytes;
+    if (zeroed != nullptr) {
+      *zeroed = fresh;
+    }
+    return p;
+  }
+
+  bool newRegion() {
+    auto mem = (char *) source->allocRegion();
+    if (mem == nullptr) {
+      return false;
+    }
+    // Mapped lazily by the kernel: mark bits for untouched pages cost nothing.
+    auto r = (Region *) mmap(nullptr, sizeof(Region), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (r == (Region *) MAP_FAILED) {
+      perror("Region map failed");
+      return false;
+    }
+    r->start = r->end = mem;
+    r->nextRegion = regions;
+    regions = r;
+    regionMap[(uintptr_t) mem >> RegionShift] = r;
+    current = r;
+    return true;
+  }
+
+  void insertFree(PageRun * run) {
+    auto& head = (run->pages <= MaxBinPages) ? bins[run->pages] : largeFree;
+    run->prev = nullptr;
+    run->next = head;
+    if (head != nullptr) {
+      head->prev = run;
+    }
+    head = run;
+    freePages += run->pages;
+    record(run, false);
+  }
+
+  void removeFree(PageRun * run) {
+    auto& head = (run->pages <= MaxBinPages) ? bins[run->pages] : largeFree;
+    if (run->prev != nullptr) {
+      run->prev->next = run->next;
+    } else {
+      head = run->next;
+    }
+    if (run->next != nullptr) {
+      run->next->prev = run->prev;
+    }
+    freePages -= run->pages;
+  }
+
+  SourceHeap * source;
+
+  // Region for each region-sized slot of the address space, or NULL.
+  Region ** regionMap;
+
+  // The region the heap is currently growing into.
+  Region * current;
+
+  // Every region, newest first.
+  Region * regions;
+
+  size_t freePages;
+
+  // Free runs by exact page count, and the larger ones.
+  PageRun * bins[MaxBinPages + 1];
+  PageRun * largeFree;
+
+  MetaHeap<PageRun> freeMeta;
+};
+
+// Address-ordered table of runs that live in their own mappings
+// (huge objects), searched by binary search.
+// Markers search it without the lock while the owner inserts and
+// removes under it, so entries move one at a time and every run that
+// was in the table stays findable throughout: a search may meet a run
+// twice, never miss one. Outgrown arrays are kept until
+// releaseRetired(), which the owner calls once no marker can be
+// searching them.
+class RunTable {
+public:
+  RunTable()
+    : runs (nullptr),
+      count (0),
+      capacity (0),
+      retiredCount (0)
+  {
+  }
+
+  bool insert(PageRun * run) {
+    if (count == capacity && !expand()) {
+      return false;
+    }
+    auto i = lowerBound(run->start);
+    if (i < count) {
+      // Copy the last run up before counting it, then shift the rest.
+      store(count, runs[count - 1]);
+      __atomic_store_n(&count, count + 1, __ATOMIC_RELEASE);
+      for (auto j = count - 2; j > i; j--) {
+	store(j, runs[j - 1]);
+      }
+    } else {
+      __atomic_store_n(&count, count + 1, __ATOMIC_RELEASE);
+    }
+    store(i, run);
+    return true;
+  }
+
+  void remove(PageRun * run) {
+    auto i = lowerBound(run->start);
+    if (i < count && runs[i] == run) {
+      for (auto j = i; j + 1 < count; j++) {
+	store(j, runs[j + 1]);
+      }
+      __atomic_store_n(&count, count - 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  // The run holding p, or NULL.
+  PageRun * find(void * p) {
+    auto n = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+    auto table = __atomic_load_n(&runs, __ATOMIC_ACQUIRE);
+    auto i = lowerBound(table, n, (char *) p + 1);
+    if (i == 0) {
+      return nullptr;
+    }
+    auto run = __atomic_load_n(&table[i - 1], __ATOMIC_RELAXED);
+    return run->contains(p) ? run : nullptr;
+  }
+
+  // Unmap the arrays expand() has outgrown. Only safe while nothing
+  // searches the table without the lock.
+  void releaseRetired() {
+    for (size_t i = 0; i < retiredCount; i++) {
+      munmap(retired[i].runs, retired[i].capacity * sizeof(PageRun *));
+    }
+    retiredCount = 0;
+  }
+
+private:
+
+  // Capacity doubles, so this many retired arrays is never reached.
+  enum { MaxRetired = 64 };
+
+  struct Retired {
+    PageRun ** runs;
+    size_t capacity;
+  };
+
+  void store(size_t i, PageRun * run) {
+    __atomic_store_n(&runs[i], run, __ATOMIC_RELAXED);
+  }
+
+  // Index of the first run starting at or above p.
+  size_t lowerBound(char * p) {
+    return lowerBound(runs, count, p);
+  }
+
+  static size_t lowerBound(PageRun ** table, size_t n, char * p) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+      auto mid = (lo + hi) / 2;
+      if (__atomic_load_n(&table[mid], __ATOMIC_RELAXED)->start < p) {
+	lo = mid + 1;
+      } else {
+	hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  bool expand() {
+    if (runs != nullptr && retiredCount == MaxRetired) {
+      return false;
+    }
+    auto newCapacity = capacity ? capacity * 2 : PageRun::PageSize / sizeof(PageRun *);
+    auto newRuns = (PageRun **) mmap(nullptr, newCapacity * sizeof(PageRun *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (newRuns == (PageRun **) MAP_FAILED) {
+      return false;
+    }
+    if (runs != nullptr) {
+      memcpy(newRuns, runs, count * sizeof(PageRun *));
+      retired[retiredCount].runs = runs;
+      retired[retiredCount].capacity = capacity;
+      retiredCount++;
+    }
+    // Published before any count that needs the room.
+    __atomic_store_n(&runs, newRuns, __ATOMIC_RELEASE);
+    capacity = newCapacity;
+    return true;
+  }
+
+  PageRun ** runs;
+  size_t count;
+  size_t capacity;
+  Retired retired[MaxRetired];
+  size_t retiredCount;
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef REGIONHEAP_H
+#define REGIONHEAP_H
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+
+// Reserves address space one aligned region at a time, on demand.
+// Nothing is reserved up front. The total is capped at DefaultMaxSize,
+// or at the size given by the GCMALLOC_MAX_HEAP environment variable
+// (bytes, with an optional K, M or G suffix) read at startup. Memory
+// mapped outside the regions (huge objects) is charged to the same cap.
+//
+// Regions are backed by ordinary pages unless GCMALLOC_HUGEPAGES is
+// "thp" (transparent huge pages via MADV_HUGEPAGE) or "hugetlb"
+// (MAP_HUGETLB, falling back to THP when no huge pages are reserved).
+template <unsigned LogRegionSize, size_t DefaultMaxSize>
+class RegionHeap {
+public:
+
+  enum { RegionShift = LogRegionSize };
+  static constexpr size_t RegionSize = (size_t) 1 << LogRegionSize;
+
+  enum PageMode { SmallPages, TransparentHugePages, HugeTLBPages };
+
+  enum { SmallPageSize = 4096, HugePageSize = 2 * 1024 * 1024 };
+
+  RegionHeap()
+    : maxSize (DefaultMaxSize),
+      reserved (0),
+      pageMode (SmallPages)
+  {
+    auto mode = getenv("GCMALLOC_HUGEPAGES");
+    if (mode != nullptr) {
+      if (strcmp(mode, "thp") == 0) {
+	pageMode = TransparentHugePages;
+      } else if (strcmp(mode, "hugetlb") == 0) {
+	pageMode = HugeTLBPages;
+      }
+    }
+    auto env = getenv("GCMALLOC_MAX_HEAP");
+    if (env != nullptr) {
+      char * suffix;
+      auto sz = strtoull(env, &suffix, 10);
+      switch (*suffix) {
+      case 'g': case 'G': sz <<= 10; // fall through
+      case 'm': case 'M': sz <<= 10; // fall through
+      case 'k': case 'K': sz <<= 10;
+      default: break;
+      }
+      if (sz > 0) {
+	maxSize = sz;
+      }
+    }
+    // Always allow at least one region.
+    maxSize = (maxSize + RegionSize - 1) & ~(RegionSize - 1);
+  }
+
+  // The most address space this heap will ever reserve.
+  size_t getSize() {
+    return maxSize;
+  }
+
+  // Bytes that can still be reserved.
+  size_t getRemaining() {
+    return maxSize - reserved;
+  }
+
+  // Count sz bytes mapped outside the regions against the cap.
+  // Returns false, charging nothing, if they do not fit.
+  bool charge(size_t sz) {
+    if (sz > maxSize - reserved) {
+      return false;
+    }
+    reserved += sz;
+    return true;
+  }
+
+  // Give back a charge once its mapping shrinks or is unmapped.
+  void uncharge(size_t sz) {
+    reserved -= sz;
+  }
+
+  PageMode getPageMode() {
+    return pageMode;
+  }
+
+  // The smallest aligned unit that can be purged without splitting
+  // the pages backing the heap.
+  size_t getPurgeSize() {
+    return (pageMode == SmallPages) ? SmallPageSize : HugePageSize;
+  }
+
+  // Reserve a fresh RegionSize-aligned region of RegionSize bytes.
+  // Returns NULL once the limit is reached or the kernel refuses.
+  void * allocRegion() {
+    if (reserved + RegionSize > maxSize) {
+      return nullptr;
+    }
+    // Over-map by one region, then trim to the aligned part.
+    // Regions are multiples of 2 MB, so trimming never splits a huge page.
+    auto p = (char *) MAP_FAILED;
+#if defined(MAP_HUGETLB)
+    if (pageMode == HugeTLBPages) {
+      // Not MAP_NORESERVE: an empty huge page pool must fail here, not fault later.
+      p = (char *) mmap(nullptr, 2 * RegionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+      if (p == (char *) MAP_FAILED) {
+	// Switch first, and report without perror, which may allocate and
+	// so come back here for another region.
+	pageMode = TransparentHugePages;
+	static const char msg[] = "gcmalloc: huge page map failed, using transparent huge pages\n";
+	auto unused = write(2, msg, sizeof(msg) - 1);
+	(void) unused;
+      }
+    }
+#endif
+    if (p == (char *) MAP_FAILED) {
+      p = (char *) mmap(nullptr, 2 * RegionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    }
+    if (p == (char *) MAP_FAILED) {
+      perror("Map failed");
+      return nullptr;
+    }
+    auto aligned = (char *) (((uintptr_t) p + RegionSize - 1) & ~(RegionSize - 1));
+    if (aligned > p) {
+      munmap(p, aligned - p);
+    }
+    munmap(aligned + RegionSize, p + RegionSize - aligned);
+#if defined(MADV_HUGEPAGE)
+    if (pageMode == TransparentHugePages) {
+      madvise(aligned, RegionSize, MADV_HUGEPAGE);
+    }
+#endif
+    reserved += RegionSize;
+    return aligned;
+  }
+
+private:
+  size_t maxSize;
+  size_t reserved;
+  PageMode pageMode;
+};
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef ROOTSET_H
+#define ROOTSET_H
+
+#include <sys/mman.h>
+#include <cstring>
+#include <cstddef>
+
+// A set of address ranges, kept as sorted, disjoint intervals in an
+// anonymous mapping reserved on first use, which never moves and costs
+// the GC heap nothing. Finding where a range falls is a binary search,
+// so hundreds of intervals stay cheap to consult. Not thread-safe:
+// callers lock it. A reader racing a writer still sees only parts of
+// the range it asked about.
+class RootSet {
+public:
+  // 1 MB of intervals.
+  enum { MaxIntervals = 1 << 16 };
+
+  RootSet()
+    : intervals (nullptr),
+      count (0)
+  {
+  }
+
+  // Add [start, end), merging it with the intervals it overlaps or
+  // touches. Returns false if that needs more than MaxIntervals.
+  bool add(void * start, void * end) {
+    auto s = (char *) start;
+    auto e = (char *) end;
+    if (s >= e) {
+      return true;
+    }
+    auto i = find(s);
+    if (i > 0 && intervals[i - 1].end == s) {
+      i--;
+    }
+    auto j = i;
+    while (j < count && intervals[j].start <= e) {
+      j++;
+    }
+    if (i == j) {
+      if (!reserve()) {
+	return false;
+      }
+      memmove(&intervals[i + 1], &intervals[i], (count - i) * sizeof(Interval));
+      count++;
+      intervals[i].start = s;
+      intervals[i].end = e;
+      return true;
+    }
+    // Widen the first interval to cover the others, then drop them.
+    if (intervals[i].start > s) {
+      intervals[i].start = s;
+    }
+    intervals[i].end = (intervals[j - 1].end > e) ? intervals[j - 1].end : e;
+    memmove(&intervals[i + 1], &intervals[j], (count - j) * sizeof(Interval));
+    count -= j - i - 1;
+    return true;
+  }
+
+  // Take [start, end) out of the set, splitting the interval around it
+  // if there is one. Returns false if that needs more than MaxIntervals.
+  bool remove(void * start, void * end) {
+    auto s = (char *) start;
+    auto e = (char *) end;
+    if (s >= e) {
+      return true;
+    }
+    auto i = find(s);
+    if (i < count && intervals[i].start < s && intervals[i].end > e) {
+      if (!reserve()) {
+	return false;
+      }
+      memmove(&intervals[i + 1], &intervals[i], (count - i) * sizeof(Interval));
+      count++;
+      intervals[i].end = s;
+      intervals[i + 1].start = e;
+      return true;
+    }
+    if (i < count && intervals[i].start < s) {
+      intervals[i].end = s;
+      i++;
+    }
+    auto j = i;
+    while (j < count && intervals[j].end <= e) {
+      j++;
+    }
+    if (j < count && intervals[j].start < e) {
+      intervals[j].start = e;
+    }
+    memmove(&intervals[i], &intervals[j], (count - j) * sizeof(Interval));
+    count -= j - i;
+    return true;
+  }
+
+  // Call f(start, end) on every interval, in address order.
+  template <class F>
+  void forEach(F f) {
+    for (size_t i = 0; i < count; i++) {
+      f(intervals[i].start, intervals[i].end);
+    }
+  }
+
+  // Call f(start, end) on each part of [start, end) outside the set, in
+  // address order.
+  template <class F>
+  void clip(void * start, void * end, F f) {
+    auto p = (char *) start;
+    auto e = (char *) end;
+    for (auto i = find(p); i < count && intervals[i].start < e; i++) {
+      if (intervals[i].start > p) {
+	f(p, intervals[i].start);
+      }
+      if (intervals[i].end > p) {
+	p = intervals[i].end;
+      }
+    }
+    if (p < e) {
+      f(p, e);
+    }
+  }
+
+  bool isEmpty() {
+    return count == 0;
+  }
+
+private:
+
+  struct Interval {
+    char * start;
+    char * end;
+  };
+
+  // The index of the first interval ending after p.
+  size_t find(char * p) {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+      auto mid = (lo + hi) / 2;
+      if (intervals[mid].end <= p) {
+	lo = mid + 1;
+      } else {
+	hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  // Make room for one more interval.
+  bool reserve() {
+    if (intervals == nullptr) {
+      auto p = mmap(nullptr, MaxIntervals * sizeof(Interval), PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+      if (p == MAP_FAILED) {
+	return false;
+      }
+      intervals = (Interval *) p;
+    }
+    return count < MaxIntervals;
+  }
+
+  Interval * intervals;
+  size_t count;
+};
+
+#endif
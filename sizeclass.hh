@@ -0,0 +1,82 @@
+#ifndef SIZECLASS_H
+#define SIZECLASS_H
+
+#include <cstddef>
+
+// Size classes, all computed at compile time.
+//
+// Class 0 is unused. Classes 1 to 1024 are the exact multiples of 16 up
+// to 16 KB, so a small request of sz bytes is in class (sz + 15) >> 4.
+// Above 16 KB every power of two is split into four classes, up to
+// 512 MB: the class comes from the position of the leading one bit of
+// (sz - 1) and the two bits below it, so no request wastes more than a
+// quarter of its size to rounding.
+class SizeClass {
+public:
+  // Exact classes are multiples of Base up to Threshold.
+  enum { Base = 16, BaseShift = 4 };
+  enum { ThresholdShift = 14, Threshold = 1 << ThresholdShift };
+  enum { SmallClasses = Threshold / Base + 1 };
+
+  // Classes per power of two above Threshold (1 << StepBits).
+  enum { StepBits = 2, StepsPerDoubling = 1 << StepBits };
+
+  // The largest size we allocate is 1 << MaxShift (512 MB).
+  enum { MaxShift = 29 };
+
+  enum { NumClasses = SmallClasses + (MaxShift - ThresholdShift) * StepsPerDoubling };
+
+  static constexpr size_t MaxSize = (size_t) 1 << MaxShift;
+
+  // Return the size class for a given size, or -1 if it is too large.
+  static constexpr int getSizeClass(size_t sz) {
+    return (sz == 0) ?
+      1 :
+      (sz > MaxSize) ?
+        -1 :
+        (sz <= Threshold) ?
+          (int) ((sz + Base - 1) >> BaseShift) :
+          largeClass(sz - 1, floorLog2(sz - 1));
+  }
+
+  // Return the maximum object size of a given class (0 if invalid).
+  static size_t getSizeFromClass(int index);
+
+private:
+
+  static constexpr int floorLog2(size_t v) {
+    return (int) (sizeof(unsigned long) * 8) - __builtin_clzl(v) - 1;
+  }
+
+  // v is sz - 1 and lg its floor log 2 (at least ThresholdShift).
+  static constexpr int largeClass(size_t v, int lg) {
+    return SmallClasses
+      + ((lg - ThresholdShift) << StepBits)
+      + (int) ((v >> (lg - StepBits)) & (StepsPerDoubling - 1));
+  }
+
+  // Class sizes, generated by the compiler.
+  class Table {
+  public:
+    constexpr Table()
+      : size()
+    {
+      for (int i = 1; i < SmallClasses; i++) {
+	size[i] = (size_t) i << BaseShift;
+      }
+      for (int i = SmallClasses; i < NumClasses; i++) {
+	const int lg = ThresholdShift + ((i - SmallClasses) >> StepBits);
+	const int step = (i - SmallClasses) & (StepsPerDoubling - 1);
+	size[i] = (size_t) (StepsPerDoubling + step + 1) << (lg - StepBits);
+      }
+    }
+    size_t size[NumClasses];
+  };
+};
+
+inline size_t SizeClass::getSizeFromClass(int index) {
+  static constexpr Table table;
+  return (index > 0 && index < NumClasses) ? table.size[index] : 0;
+}
+
+#endif
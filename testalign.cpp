@@ -0,0 +1,54 @@
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+using namespace std;
+
+// Checks that posix_memalign, aligned_alloc, memalign and aligned new
+// return aligned objects of the requested size, from zero-size and
+// small objects up to huge ones with alignments wider than a page.
+
+struct alignas(128) Wide {
+  char d[300];
+};
+
+int main()
+{
+  int bad = 0;
+  size_t aligns[] = { 32, 64, 256, 4096, 8192, 65536, 2 << 20 };
+  size_t sizes[] = { 0, 1, 48, 100, 1000, 5000, 20000, 100000, 3 << 20 };
+  for (int rep = 0; rep < 20; rep++) {
+    for (auto a : aligns) {
+      for (auto s : sizes) {
+	void * p = nullptr;
+	if (posix_memalign(&p, a, s) != 0 || p == nullptr || (uintptr_t) p % a || malloc_usable_size(p) < s) {
+	  cout << "posix_memalign(" << a << ", " << s << ") = " << p << endl;
+	  bad++;
+	  continue;
+	}
+	memset(p, 1, s);
+	void * q = aligned_alloc(a, s);
+	void * r = memalign(a, s);
+	if (q == nullptr || (uintptr_t) q % a || r == nullptr || (uintptr_t) r % a) {
+	  cout << "aligned_alloc/memalign(" << a << ", " << s << ") = " << q << ", " << r << endl;
+	  bad++;
+	}
+      }
+    }
+  }
+  for (int i = 0; i < 1000; i++) {
+    Wide * w = new Wide;
+    if ((uintptr_t) w % alignof(Wide)) {
+      bad++;
+    }
+    delete w;
+  }
+  void * p = nullptr;
+  cout << "posix_memalign(&p, 24, 8) = " << posix_memalign(&p, 24, 8) << " (should be EINVAL)" << endl;
+  if (p != nullptr) {
+    bad++;
+  }
+  cout << "testalign: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
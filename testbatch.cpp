@@ -0,0 +1,62 @@
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include "gcapi.h"
+using namespace std;
+
+// Checks that xxmalloc_batch returns distinct objects of the requested
+// size, small and large, and that they survive collections while only
+// the array they were written to points at them.
+
+struct Node {
+  Node * next;
+  long value[5];
+};
+
+enum { Count = 200000 };
+
+Node * nodes[Count];
+
+int main()
+{
+  int bad = 0;
+  size_t got = gcmalloc::allocateBatch(Count, nodes);
+  cout << "allocated " << got << " nodes (should be " << Count << ")" << endl;
+  if (got != Count) {
+    bad++;
+  }
+  for (size_t i = 0; i < got; i++) {
+    nodes[i]->value[0] = i;
+    if (malloc_usable_size(nodes[i]) < sizeof(Node)) {
+      bad++;
+    }
+  }
+  // Garbage, to make the collector run over the batch.
+  for (int i = 0; i < 1000000; i++) {
+    char * g = (char *) malloc(64);
+    memset(g, 0, 64);
+  }
+  for (size_t i = 0; i < got; i++) {
+    if (nodes[i]->value[0] != (long) i) {
+      cout << "node " << i << " was reused" << endl;
+      bad++;
+      break;
+    }
+  }
+  sort(nodes, nodes + got);
+  if (adjacent_find(nodes, nodes + got) != nodes + got) {
+    cout << "an object was handed out twice" << endl;
+    bad++;
+  }
+  void * big[10];
+  if (xxmalloc_batch(100000, 10, big) != 10 || malloc_usable_size(big[9]) < 100000) {
+    bad++;
+  }
+  if (xxmalloc_batch(64, 0, big) != 0) {
+    bad++;
+  }
+  cout << "testbatch: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
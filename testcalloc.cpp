@@ -0,0 +1,45 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+using namespace std;
+
+// Checks that calloc returns zeroed memory even when it reuses pages
+// just freed full of other data, and that it refuses sizes whose
+// product overflows.
+
+int main()
+{
+  int bad = 0;
+  for (int rep = 0; rep < 3000; rep++) {
+    size_t sz = 17000 + (rep * 7919) % 900000;
+    char * d = (char *) malloc(sz);
+    memset(d, 0x5a, sz);
+    free(d);
+    size_t n = 1 + (rep * 104729) % 1200000;
+    char * c = (char *) calloc(n, 1);
+    if (c == nullptr) {
+      bad++;
+      continue;
+    }
+    for (size_t i = 0; i < n; i += 509) {
+      if (c[i]) {
+	cout << "calloc(" << n << ", 1) byte " << i << " = " << (int) c[i] << endl;
+	bad++;
+	break;
+      }
+    }
+    if (c[n - 1]) {
+      bad++;
+    }
+    memset(c, 0x33, n);
+  }
+  // Volatile, so the compiler cannot see the overflow and warn.
+  volatile size_t side = (size_t) 1 << 40;
+  void * huge = calloc(side, side);
+  cout << "calloc(2^40, 2^40) = " << huge << " (should be 0)" << endl;
+  if (huge != nullptr) {
+    bad++;
+  }
+  cout << "testcalloc: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
@@ -0,0 +1,50 @@
+#include <iostream>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+using namespace std;
+
+// Checks that huge objects, mapped apart from the regions, count
+// against GCMALLOC_MAX_HEAP: one larger than the cap fails with
+// ENOMEM, a realloc past it fails and keeps the old object, and
+// garbage huge objects give their share back once collected. Runs
+// with a 256 MB cap unless told otherwise.
+
+int main(int, char ** argv)
+{
+  if (getenv("GCMALLOC_MAX_HEAP") == nullptr) {
+    setenv("GCMALLOC_MAX_HEAP", "256M", 1);
+    execv("/proc/self/exe", argv);
+  }
+  int bad = 0;
+  errno = 0;
+  void * over = malloc((size_t) 512 << 20);
+  cout << "malloc(512 MB) = " << over << ", errno " << errno << " (should be 0, " << ENOMEM << ")" << endl;
+  if (over != nullptr || errno != ENOMEM) {
+    bad++;
+  }
+  // Ten times the cap in all, never more than one live at a time.
+  int failed = 0;
+  for (int i = 0; i < 40; i++) {
+    char * g = (char *) malloc(64 << 20);
+    if (g == nullptr) {
+      failed++;
+      continue;
+    }
+    memset(g, i, 4096);
+  }
+  cout << "64 MB garbage refused " << failed << " of 40 times (should be 0)" << endl;
+  if (failed) {
+    bad++;
+  }
+  char * p = (char *) malloc(16 << 20);
+  memset(p, 0x5a, 16 << 20);
+  char * q = (char *) realloc(p, (size_t) 512 << 20);
+  cout << "realloc to 512 MB = " << (void *) q << " (should be 0)" << endl;
+  if (q != nullptr || p[(16 << 20) - 1] != 0x5a) {
+    bad++;
+  }
+  cout << "testcap: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
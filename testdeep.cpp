@@ -0,0 +1,99 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <unistd.h>
+using namespace std;
+
+// Checks that marking survives deep object graphs: a million-node list,
+// and a list whose every node also holds leaves, ordered so that each
+// node leaves its leaves behind on the mark stack. The
+// second leaves more than the mark stack holds, so the collector must
+// recover by rescanning the marked objects. Runs with one marker, which
+// no other steals from, unless told otherwise.
+
+struct Node {
+  Node * next;
+  long value;
+};
+
+struct Leaf {
+  long value;
+};
+
+// The next node first: it leaves the marker's prefetch queue (eight
+// deep) ahead of the leaves, which are pushed once the next node is
+// scanned, and stay on the stack below the rest of the list.
+struct Fan {
+  Fan * next;
+  Leaf * leaves[8];
+};
+
+// Garbage, written over, to reuse whatever a collection wrongly freed.
+static void churn(long n)
+{
+  for (long i = 0; i < n; i++) {
+    void * g = malloc(16);
+    memset(g, 0xff, 16);
+  }
+}
+
+int main(int, char ** argv)
+{
+  if (getenv("GCMALLOC_MARKERS") == nullptr) {
+    setenv("GCMALLOC_MARKERS", "1", 1);
+    execv("/proc/self/exe", argv);
+  }
+  int bad = 0;
+
+  const long Length = 1000000;
+  Node * head = nullptr;
+  for (long i = 0; i < Length; i++) {
+    Node * n = (Node *) malloc(sizeof(Node));
+    n->next = head;
+    n->value = i;
+    head = n;
+  }
+  malloc_trim(0);
+  churn(4000000);
+  long i = Length - 1;
+  for (Node * n = head; n != nullptr && n->value == i; n = n->next) {
+    i--;
+  }
+  cout << "deep list intact: " << (i == -1 ? "yes" : "no") << " (should be yes)" << endl;
+  if (i != -1) {
+    bad++;
+  }
+  head = nullptr;
+
+  // Eight leaves left per node: past MarkStack::MaxEntries (4M).
+  const long Fans = 600000;
+  Fan * fans = nullptr;
+  for (long j = 0; j < Fans; j++) {
+    Fan * f = (Fan *) malloc(sizeof(Fan));
+    for (int k = 0; k < 8; k++) {
+      f->leaves[k] = (Leaf *) malloc(sizeof(Leaf));
+      f->leaves[k]->value = j * 8 + k;
+    }
+    f->next = fans;
+    fans = f;
+  }
+  malloc_trim(0);
+  churn(4000000);
+  long lost = 0;
+  long j = Fans - 1;
+  for (Fan * f = fans; f != nullptr; f = f->next, j--) {
+    for (int k = 0; k < 8; k++) {
+      if (f->leaves[k]->value != j * 8 + k) {
+	lost++;
+      }
+    }
+  }
+  cout << "leaves lost past mark stack overflow: " << lost << " (should be 0)" << endl;
+  if (lost || j != -1) {
+    bad++;
+  }
+
+  cout << "testdeep: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
@@ -0,0 +1,101 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include "gcapi.h"
+using namespace std;
+
+// Checks that objects held only by the frames of parked fibers, on
+// stacks from malloc registered with xxgc_fiber_register, survive
+// collections. The fibers save their registers outside the heap, where
+// only xxgc_fiber_suspend tells the collector to look.
+
+enum { Fibers = 500, StackSize = 64 * 1024, Length = 50 };
+
+struct Node {
+  Node * next;
+  long value;
+  char pad[40];
+};
+
+static ucontext_t mainContext;
+static ucontext_t * contexts;
+static xxgc_fiber ** fibers;
+static int current;
+static long bad;
+
+static void park(int i)
+{
+  xxgc_fiber_suspend(fibers[i], nullptr, &contexts[i], sizeof(ucontext_t));
+  swapcontext(&contexts[i], &mainContext);
+  xxgc_fiber_resume(fibers[i]);
+}
+
+static void run()
+{
+  int i = current;
+  Node * head = nullptr;
+  for (long k = 0; k < Length; k++) {
+    Node * n = (Node *) malloc(sizeof(Node));
+    n->next = head;
+    n->value = i * Length + k;
+    memset(n->pad, 0x33, sizeof(n->pad));
+    head = n;
+  }
+  park(i);
+  park(i);
+  long k = Length - 1;
+  for (Node * n = head; n != nullptr; n = n->next, k--) {
+    if (n->value != i * Length + k || n->pad[7] != 0x33) {
+      break;
+    }
+  }
+  if (k != -1) {
+    bad++;
+  }
+  swapcontext(&contexts[i], &mainContext);
+}
+
+static void churn()
+{
+  for (int i = 0; i < 2000000; i++) {
+    char * g = (char *) malloc(64);
+    memset(g, 0, 64);
+  }
+}
+
+int main()
+{
+  // Outside the heap, so that nothing but registration keeps the stacks.
+  contexts = (ucontext_t *) mmap(nullptr, Fibers * sizeof(ucontext_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  fibers = (xxgc_fiber **) mmap(nullptr, Fibers * sizeof(xxgc_fiber *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  for (int i = 0; i < Fibers; i++) {
+    char * stack = (char *) malloc(StackSize);
+    fibers[i] = xxgc_fiber_register(stack, StackSize);
+    if (fibers[i] == nullptr) {
+      bad++;
+    }
+    getcontext(&contexts[i]);
+    contexts[i].uc_stack.ss_sp = stack;
+    contexts[i].uc_stack.ss_size = StackSize;
+    contexts[i].uc_link = nullptr;
+    makecontext(&contexts[i], run, 0);
+    current = i;
+    swapcontext(&mainContext, &contexts[i]);
+  }
+  churn();
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < Fibers; i++) {
+      current = i;
+      swapcontext(&mainContext, &contexts[i]);
+    }
+    churn();
+  }
+  for (int i = 0; i < Fibers; i++) {
+    xxgc_fiber_unregister(fibers[i]);
+  }
+  cout << "fibers with damaged lists: " << bad << " (should be 0)" << endl;
+  cout << "testfiber: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
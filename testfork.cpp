@@ -0,0 +1,85 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <unistd.h>
+using namespace std;
+
+// Checks that a child forked after the parent has collected can collect
+// in turn: the marker pool (and a lazy sweeper) did not survive the
+// fork, and must start again, with as many threads as the parent has.
+// Runs with four markers unless told otherwise.
+
+struct Node {
+  Node * next;
+  long value;
+};
+
+static Node * build(long n)
+{
+  Node * head = nullptr;
+  for (long i = 0; i < n; i++) {
+    Node * node = (Node *) malloc(sizeof(Node));
+    node->next = head;
+    node->value = i;
+    head = node;
+  }
+  return head;
+}
+
+static bool intact(Node * head, long n)
+{
+  for (long i = n - 1; i >= 0; i--, head = head->next) {
+    if (head == nullptr || head->value != i) {
+      return false;
+    }
+  }
+  return head == nullptr;
+}
+
+// The threads of this process: the collector's own, once started.
+static int threads()
+{
+  int n = 0;
+  DIR * d = opendir("/proc/self/task");
+  while (readdir(d) != nullptr) {
+    n++;
+  }
+  closedir(d);
+  return n - 2;
+}
+
+static void churn()
+{
+  for (int i = 0; i < 2000000; i++) {
+    char * g = (char *) malloc(64);
+    memset(g, 0, 64);
+  }
+}
+
+int main(int, char ** argv)
+{
+  if (getenv("GCMALLOC_MARKERS") == nullptr) {
+    setenv("GCMALLOC_MARKERS", "4", 1);
+    execv("/proc/self/exe", argv);
+  }
+  Node * list = build(100000);
+  churn();
+  int parentThreads = threads();
+  pid_t pid = fork();
+  if (pid == 0) {
+    // A hung collection fails the test rather than the whole check.
+    alarm(30);
+    churn();
+    // The same markers and sweeper as the parent, started afresh.
+    _exit(intact(list, 100000) && threads() == parentThreads ? 0 : 1);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  bool childOk = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  cout << "child collected after fork: " << (childOk ? "yes" : "no") << " (should be yes)" << endl;
+  bool bad = !childOk || !intact(list, 100000);
+  cout << "testfork: " << (bad ? "FAILED" : "ok") << endl;
+  return bad;
+}
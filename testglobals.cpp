@@ -0,0 +1,90 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+using namespace std;
+
+// Checks that global pages the collector found free of heap pointers,
+// and so skips until written, are scanned again once written: objects
+// referenced only from such pages, and then moved to other clean
+// pages, survive collections.
+
+enum { TableWords = 2 << 20, PageWords = 4096 / sizeof(void *), Kept = 64 };
+
+// 16 MB of globals, enough for the collector to track their writes.
+static long * table[TableWords];
+
+// A different page of the table for each object, from a given one on.
+static size_t slot(int i, int from)
+{
+  return (size_t) (from + i * 61) % (TableWords / PageWords) * PageWords + 7;
+}
+
+static void __attribute__((noinline)) fill(int from)
+{
+  for (int i = 0; i < Kept; i++) {
+    long * p = (long *) malloc(Kept * sizeof(long));
+    for (int k = 0; k < Kept; k++) {
+      p[k] = i * Kept + k;
+    }
+    table[slot(i, from)] = p;
+  }
+}
+
+static void __attribute__((noinline)) move(int from, int to)
+{
+  for (int i = 0; i < Kept; i++) {
+    table[slot(i, to)] = table[slot(i, from)];
+    table[slot(i, from)] = nullptr;
+  }
+}
+
+// Garbage the size of the kept objects, written over, then a full
+// collection.
+static void collect()
+{
+  for (int i = 0; i < 200000; i++) {
+    void * g = malloc(Kept * sizeof(long));
+    memset(g, 0xff, Kept * sizeof(long));
+  }
+  malloc_trim(0);
+}
+
+static int lost(int from)
+{
+  int n = 0;
+  for (int i = 0; i < Kept; i++) {
+    long * p = table[slot(i, from)];
+    for (int k = 0; k < Kept; k++) {
+      if (p == nullptr || p[k] != i * Kept + k) {
+	n++;
+	break;
+      }
+    }
+  }
+  return n;
+}
+
+int main()
+{
+  int bad = 0;
+  // Every page clean, for a few collections.
+  for (int i = 0; i < 3; i++) {
+    collect();
+  }
+  fill(0);
+  collect();
+  collect();
+  int written = lost(0);
+  cout << "objects lost from written pages: " << written << " (should be 0)" << endl;
+  move(0, 2000);
+  collect();
+  collect();
+  int moved = lost(2000);
+  cout << "objects lost after moving to clean pages: " << moved << " (should be 0)" << endl;
+  if (written || moved) {
+    bad++;
+  }
+  cout << "testglobals: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
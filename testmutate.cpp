@@ -0,0 +1,69 @@
+#include <iostream>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+using namespace std;
+
+// Checks that objects survive while threads keep moving the only
+// pointers to them around as collections run: the case a concurrent
+// or incremental mark must catch up with before it sweeps. Run under
+// GCMALLOC_CONCURRENT=1 or GCMALLOC_PAUSE_US to test those modes.
+
+enum { Threads = 4, Slots = 50000, Rounds = 400000 };
+
+struct Cell {
+  long id;
+  long check;
+  char pad[48];
+};
+
+atomic<long> bad(0);
+
+static void * mutate(void * arg)
+{
+  long seed = (long) arg + 1;
+  Cell ** slots = (Cell **) malloc(Slots * sizeof(Cell *));
+  for (long i = 0; i < Slots; i++) {
+    slots[i] = (Cell *) malloc(sizeof(Cell));
+    slots[i]->id = i;
+    slots[i]->check = i * 7;
+  }
+  for (long r = 0; r < Rounds; r++) {
+    seed = seed * 6364136223846793005L + 1442695040888963407L;
+    auto i = (unsigned long) seed % Slots;
+    auto j = (unsigned long) (seed >> 20) % Slots;
+    // Swap two cells; only this frame holds them while the garbage
+    // below is allocated.
+    Cell * moving = slots[i];
+    Cell * other = slots[j];
+    slots[i] = nullptr;
+    slots[j] = nullptr;
+    char * garbage = (char *) malloc(64 + r % 200);
+    memset(garbage, 0, 64);
+    slots[i] = other;
+    slots[j] = moving;
+  }
+  long * seen = (long *) calloc(Slots, sizeof(long));
+  for (long i = 0; i < Slots; i++) {
+    Cell * c = slots[i];
+    if (c == nullptr || c->id < 0 || c->id >= Slots || c->check != c->id * 7 || seen[c->id]++) {
+      bad++;
+    }
+  }
+  return nullptr;
+}
+
+int main()
+{
+  pthread_t threads[Threads];
+  for (long i = 0; i < Threads; i++) {
+    pthread_create(&threads[i], nullptr, mutate, (void *) i);
+  }
+  for (long i = 0; i < Threads; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  cout << "lost or damaged cells: " << bad << " (should be 0)" << endl;
+  cout << "testmutate: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
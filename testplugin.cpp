@@ -0,0 +1,28 @@
+#include <cstdlib>
+#include <cstring>
+
+// Loaded by testtls: keeps heap objects reachable only from its own
+// globals and thread-local storage.
+
+static char * globalRef;
+static __thread char * tlsRef;
+
+extern "C" void plugin_set(int round)
+{
+  globalRef = (char *) malloc(3000);
+  memset(globalRef, round, 3000);
+  tlsRef = (char *) malloc(3000);
+  memset(tlsRef, round + 1, 3000);
+}
+
+extern "C" long plugin_check(int round)
+{
+  long bad = 0;
+  for (int i = 0; i < 3000; i++) {
+    if (globalRef[i] != (char) round || tlsRef[i] != (char) (round + 1)) {
+      bad++;
+      break;
+    }
+  }
+  return bad;
+}
@@ -0,0 +1,55 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+using namespace std;
+
+// Checks that realloc keeps an object's contents while growing it from
+// 10 bytes to a huge object and shrinking it back, and that it resizes
+// in place at least some of the time.
+
+int main()
+{
+  int bad = 0, inPlace = 0;
+  for (int rep = 0; rep < 20; rep++) {
+    size_t n = 10;
+    char * p = (char *) malloc(n);
+    memset(p, 'a', n);
+    while (n < (8u << 20)) {
+      size_t m = n + n / 4 + 7;
+      char * q = (char *) realloc(p, m);
+      if (q == nullptr) {
+	bad++;
+	break;
+      }
+      inPlace += (q == p);
+      for (size_t i = 0; i < n; i += 997) {
+	if (q[i] != 'a') {
+	  cout << "realloc to " << m << " lost byte " << i << endl;
+	  bad++;
+	  break;
+	}
+      }
+      if (q[n - 1] != 'a') {
+	bad++;
+      }
+      memset(q, 'a', m);
+      p = q;
+      n = m;
+    }
+    char * s = (char *) realloc(p, 100);
+    if (s == nullptr || s[99] != 'a' || malloc_usable_size(s) < 100) {
+      bad++;
+    }
+  }
+  char * fresh = (char *) realloc(nullptr, 50);
+  if (fresh == nullptr || malloc_usable_size(fresh) < 50) {
+    bad++;
+  }
+  cout << "resized in place " << inPlace << " times (should be more than 0)" << endl;
+  if (inPlace == 0) {
+    bad++;
+  }
+  cout << "testrealloc: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
@@ -0,0 +1,80 @@
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include "gcapi.h"
+using namespace std;
+
+// Checks that objects held only by a mapping added with xxgc_add_roots
+// survive collections, that a range taken out with xxgc_remove_roots
+// can be unmapped, and that objects held only by globals left out with
+// xxgc_exclude_roots are reclaimed.
+
+enum { Count = 16384 };
+
+static void * hidden[Count];
+
+static void churn()
+{
+  for (int i = 0; i < 4000000; i++) {
+    char * g = (char *) malloc(48);
+    memset(g, 0, 48);
+  }
+}
+
+static long damaged(void ** objects, int n)
+{
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < 48; j++) {
+      if (((unsigned char *) objects[i])[j] != (i & 0xff)) {
+	return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+int main()
+{
+  long bad = 0;
+  auto arena = (void **) mmap(nullptr, 2 * Count * sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (!xxgc_add_roots(arena, arena + 2 * Count)) {
+    bad++;
+  }
+  for (int i = 0; i < 2 * Count; i++) {
+    arena[i] = malloc(48);
+    memset(arena[i], i & 0xff, 48);
+  }
+  if (!xxgc_exclude_roots(hidden, hidden + Count)) {
+    bad++;
+  }
+  for (int i = 0; i < Count; i++) {
+    hidden[i] = malloc(48);
+  }
+  churn();
+  bad += damaged(arena, 2 * Count);
+
+  // Reclaimed objects come back from malloc.
+  auto sorted = (void **) mmap(nullptr, Count * sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  memcpy(sorted, hidden, Count * sizeof(void *));
+  sort(sorted, sorted + Count);
+  long reused = 0;
+  for (int i = 0; i < 200000; i++) {
+    reused += binary_search(sorted, sorted + Count, malloc(48));
+  }
+  cout << "excluded objects reused: " << reused << " (should be more than 0)" << endl;
+  if (reused == 0) {
+    bad++;
+  }
+
+  // The second half of the arena goes away; the first must still count.
+  if (!xxgc_remove_roots(arena + Count, arena + 2 * Count)) {
+    bad++;
+  }
+  munmap(arena + Count, Count * sizeof(void *));
+  churn();
+  bad += damaged(arena, Count);
+  cout << "testroots: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
@@ -0,0 +1,33 @@
+#include <iostream>
+#include <cstdlib>
+#include <malloc.h>
+using namespace std;
+
+// Checks that xxmalloc_good_size answers with the size malloc really
+// gives, and wastes at most a quarter of a request above 16 KB.
+
+extern "C"
+{
+  size_t xxmalloc_good_size(size_t);
+}
+
+int main()
+{
+  int bad = 0;
+  for (size_t sz = 1; sz < 4 * 1024 * 1024; sz += (sz < 20000) ? 1 : sz / 7) {
+    size_t good = xxmalloc_good_size(sz);
+    void * p = malloc(sz);
+    size_t usable = malloc_usable_size(p);
+    if (good < sz || usable != good || (sz > 16384 && good - sz > sz / 4)) {
+      cout << "size " << sz << ": good size " << good << ", usable " << usable << endl;
+      bad++;
+    }
+    free(p);
+  }
+  cout << "good size of 17 KB = " << xxmalloc_good_size(17 * 1024) << " (should be 20480)" << endl;
+  if (xxmalloc_good_size(17 * 1024) != 20480) {
+    bad++;
+  }
+  cout << "testsize: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
@@ -0,0 +1,44 @@
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+using namespace std;
+
+// Checks that garbage is reclaimed and its memory handed out again,
+// small and large objects alike: with GCMALLOC_LAZY_SWEEP=1 that
+// happens only as allocation sweeps the spans, a few at a time.
+
+enum { Count = 10000 };
+
+// Outside the heap, so that remembering an address keeps nothing alive.
+static long reused(size_t size)
+{
+  auto seen = (char **) mmap(nullptr, Count * sizeof(char *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  for (int i = 0; i < Count; i++) {
+    seen[i] = (char *) malloc(size);
+    memset(seen[i], 1, size);
+  }
+  sort(seen, seen + Count);
+  long found = 0;
+  for (int i = 0; i < 40 * Count; i++) {
+    auto p = (char *) malloc(size);
+    memset(p, 2, size);
+    found += binary_search(seen, seen + Count, p);
+  }
+  munmap(seen, Count * sizeof(char *));
+  return found;
+}
+
+int main()
+{
+  int bad = 0;
+  size_t sizes[] = { 48, 1000, 40000 };
+  for (auto size : sizes) {
+    auto n = reused(size);
+    cout << size << "-byte garbage reused " << n << " times (should be more than 0)" << endl;
+    bad += (n == 0);
+  }
+  cout << "testsweep: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
@@ -0,0 +1,67 @@
+#include <iostream>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <pthread.h>
+using namespace std;
+
+// Checks that each thread's objects survive collections started by
+// other threads while only its own stack points at them, including in
+// a thread that blocked every signal first.
+
+enum { Threads = 4, Rounds = 10, Length = 20000 };
+
+struct Node {
+  Node * next;
+  long value;
+  long pad[2];
+};
+
+atomic<long> bad(0);
+
+static void * build(void * arg)
+{
+  long id = (long) arg;
+  if (id == 0) {
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, nullptr);
+  }
+  for (int r = 0; r < Rounds; r++) {
+    Node * volatile head = nullptr;
+    for (long i = 0; i < Length; i++) {
+      Node * n = (Node *) malloc(sizeof(Node));
+      n->next = head;
+      n->value = id * Length + i;
+      head = n;
+      // Garbage, to start collections in every thread.
+      if (i % 4 == 0 && malloc(200) == nullptr) {
+	bad++;
+      }
+    }
+    long i = Length - 1;
+    for (Node * n = head; n != nullptr; n = n->next, i--) {
+      if (n->value != id * Length + i) {
+	break;
+      }
+    }
+    if (i != -1) {
+      bad++;
+    }
+  }
+  return nullptr;
+}
+
+int main()
+{
+  pthread_t threads[Threads];
+  for (long i = 0; i < Threads; i++) {
+    pthread_create(&threads[i], nullptr, build, (void *) i);
+  }
+  for (long i = 0; i < Threads; i++) {
+    pthread_join(threads[i], nullptr);
+  }
+  cout << "damaged lists: " << bad << " (should be 0)" << endl;
+  cout << "testthreads: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
@@ -0,0 +1,47 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+using namespace std;
+
+// Checks that objects held only by the main thread's TLS, or by the
+// globals and TLS of a library loaded with dlopen, survive collections,
+// over rounds of loading and unloading the library.
+
+static __thread char * tlsRef;
+
+int main()
+{
+  long bad = 0;
+  tlsRef = (char *) malloc(5000);
+  memset(tlsRef, 0x11, 5000);
+  for (int round = 0; round < 20; round++) {
+    void * h = dlopen("./testplugin.so", RTLD_NOW);
+    if (h == nullptr) {
+      cout << "dlopen: " << dlerror() << endl;
+      return 1;
+    }
+    auto set = (void (*)(int)) dlsym(h, "plugin_set");
+    auto check = (long (*)(int)) dlsym(h, "plugin_check");
+    set(round);
+    for (int i = 0; i < 300000; i++) {
+      char * g = (char *) malloc(64);
+      memset(g, 0, 64);
+    }
+    bad += check(round);
+    for (int i = 0; i < 5000; i++) {
+      if (tlsRef[i] != 0x11) {
+	bad++;
+	break;
+      }
+    }
+    dlclose(h);
+    for (int i = 0; i < 100000; i++) {
+      char * g = (char *) malloc(64);
+      memset(g, 0, 64);
+    }
+  }
+  cout << "damaged objects: " << bad << " (should be 0)" << endl;
+  cout << "testtls: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
@@ -0,0 +1,53 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <unistd.h>
+using namespace std;
+
+// Checks that malloc_trim gives the pages of freed objects back to the
+// system: after a spike of large objects that became garbage, it reports
+// a purge, and the resident set shrinks.
+
+// Resident memory, in MB.
+static long residentMB()
+{
+  long pages = 0, resident = 0;
+  FILE * f = fopen("/proc/self/statm", "r");
+  if (f != nullptr) {
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return resident * sysconf(_SC_PAGESIZE) >> 20;
+}
+
+enum { Spike = 2000, SpikeSize = 100000 };
+
+// 200 MB of large objects, written and then dropped.
+static void __attribute__((noinline)) spike()
+{
+  char ** objs = (char **) malloc(Spike * sizeof(char *));
+  for (int i = 0; i < Spike; i++) {
+    objs[i] = (char *) malloc(SpikeSize);
+    memset(objs[i], i, SpikeSize);
+  }
+  memset(objs, 0, Spike * sizeof(char *));
+}
+
+int main()
+{
+  int bad = 0;
+  spike();
+  long before = residentMB();
+  int trimmed = malloc_trim(0);
+  long after = residentMB();
+  cout << "malloc_trim(0) = " << trimmed << " (should be 1)" << endl;
+  cout << "resident " << before << " MB before, " << after << " MB after (should drop by at least 100 MB)" << endl;
+  if (trimmed != 1 || before - after < 100) {
+    bad++;
+  }
+  cout << "testtrim: " << (bad ? "FAILED" : "ok") << endl;
+  return bad != 0;
+}
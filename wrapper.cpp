@@ -41,17 +41,55 @@ extern "C" {
   void * xxmalloc (size_t);
   void   xxfree (void *);
 
+  // Returns a zero-filled array, clearing only memory that may be dirty.
+  void * xxcalloc (size_t, size_t);
+
+  // Resizes an object, in place when possible; NULL on failure.
+  void * xxrealloc (void *, size_t);
+
+  // Returns an object aligned to the given power of two, or NULL.
+  void * xxmemalign (size_t, size_t);
+
   // Takes a pointer and returns how much space it holds.
   size_t xxmalloc_usable_size (void *);
 
+  // Returns how much space an allocation of the given size would hold.
+  size_t xxmalloc_good_size (size_t);
+
+  // Returns free memory to the OS; nonzero iff any was released.
+  int xxmalloc_trim (size_t);
+
+  // Prints allocator statistics.
+  void xxmalloc_stats (void);
+
   // Locks the heap(s), used prior to any invocation of fork().
   void xxmalloc_lock (void);
 
   // Unlocks the heap(s), after fork().
   void xxmalloc_unlock (void);
 
+  // Tell the heap what code allocated or freed an object (the return
+  // address of the call below), so it can tell the loader's objects apart.
+  void xxmalloc_note (void * ptr, void * caller);
+  void xxfree_note (void * ptr, void * caller);
+
+  // The dynamic loader's code, [xxloader_text[0], xxloader_text[1]):
+  // only calls from there are worth noting.
+  extern void * xxloader_text[2];
+
+}
+
+static inline bool fromLoader (void * caller)
+{
+  return caller >= xxloader_text[0] && caller < xxloader_text[1];
 }
 
+#if defined(__GNUC__)
+#define CALLER_ADDRESS() __builtin_return_address(0)
+#else
+#define CALLER_ADDRESS() NULL
+#endif
+
 #if defined(__APPLE__)
 #include <malloc/malloc.h>
 #elif defined(__FreeBSD__)
@@ -130,6 +168,10 @@ extern "C" {
 
 extern "C" void MYCDECL CUSTOM_FREE (void * ptr)
 {
+  void * caller = CALLER_ADDRESS();
+  if (fromLoader (caller)) {
+    xxfree_note (ptr, caller);
+  }
   xxfree (ptr);
 }
 
@@ -138,7 +180,11 @@ extern "C" void * MYCDECL CUSTOM_MALLOC(size_t sz)
   if (sz >> (sizeof(size_t) * 8 - 1)) {
     return NULL;
   }
+  void * caller = CALLER_ADDRESS();
   void * ptr = xxmalloc(sz);
+  if (fromLoader (caller)) {
+    xxmalloc_note (ptr, caller);
+  }
   return ptr;
 }
 
@@ -148,10 +194,14 @@ extern "C" void * MYCDECL CUSTOM_CALLOC(size_t nelem, size_t elsize)
   if (elsize && nelem != n / elsize) {
     return NULL;
   }
-  void * ptr = CUSTOM_MALLOC(n);
-  // Zero out the malloc'd block.
-  if (ptr != NULL) {
-    memset (ptr, 0, n);
+  if (n >> (sizeof(size_t) * 8 - 1)) {
+    return NULL;
+  }
+  // Zeroes the block, unless it is known to be zero already.
+  void * caller = CALLER_ADDRESS();
+  void * ptr = xxcalloc (nelem, elsize);
+  if (fromLoader (caller)) {
+    xxmalloc_note (ptr, caller);
   }
   return ptr;
 }
@@ -198,22 +248,15 @@ extern "C" void * MYCDECL CUSTOM_MEMALIGN (size_t alignment, size_t size)
       return NULL;
     }
 
-  if (alignment == sizeof(double)) {
-    return CUSTOM_MALLOC (size);
-  } else {
-    // Try to just allocate an object of the requested size.
-    // If it happens to be aligned properly, just return it.
-    void * ptr = CUSTOM_MALLOC(size);
-    if (((size_t) ptr & (alignment - 1)) == (size_t) ptr) {
-      // It is already aligned just fine; return it.
-      return ptr;
-    }
-    // It was not aligned as requested: free the object and allocate a big one.
-    CUSTOM_FREE(ptr);
-    ptr = CUSTOM_MALLOC (size + 2 * alignment);
-    void * alignedPtr = (void *) (((size_t) ptr + alignment - 1) & ~(alignment - 1));
-    return alignedPtr;
+  if (size >> (sizeof(size_t) * 8 - 1)) {
+    return NULL;
+  }
+  void * caller = CALLER_ADDRESS();
+  void * ptr = xxmemalign (alignment, size);
+  if (fromLoader (caller)) {
+    xxmalloc_note (ptr, caller);
   }
+  return ptr;
 }
 
 extern "C" void * MYCDECL CUSTOM_ALIGNED_ALLOC(size_t alignment, size_t size)
@@ -225,7 +268,9 @@ extern "C" void * MYCDECL CUSTOM_ALIGNED_ALLOC(size_t alignment, size_t size)
   // memalign(), except for the added restriction that size should be
   // a multiple of alignment." Rather than check and potentially fail,
   // we just enforce this by rounding up the size, if necessary.
-  size = size + alignment - (size % alignment);
+  if (alignment && size % alignment) {
+    size = size + alignment - (size % alignment);
+  }
   return CUSTOM_MEMALIGN(alignment, size);
 }
 
@@ -240,20 +285,29 @@ extern "C" void MYCDECL CUSTOM_CFREE (void * ptr)
 }
 
 extern "C" size_t MYCDECL CUSTOM_GOODSIZE (size_t sz) {
-  void * ptr = CUSTOM_MALLOC(sz);
-  size_t objSize = CUSTOM_GETSIZE(ptr);
-  CUSTOM_FREE(ptr);
-  return objSize;
+  return xxmalloc_good_size(sz);
 }
 
 extern "C" void * MYCDECL CUSTOM_REALLOC (void * ptr, size_t sz)
 {
+  void * caller = CALLER_ADDRESS();
+  // Straight to the heap, not through CUSTOM_MALLOC and CUSTOM_FREE,
+  // which would note the object a second time for another caller.
   if (ptr == NULL) {
-    ptr = CUSTOM_MALLOC (sz);
+    if (sz >> (sizeof(size_t) * 8 - 1)) {
+      return NULL;
+    }
+    ptr = xxmalloc (sz);
+    if (fromLoader (caller)) {
+      xxmalloc_note (ptr, caller);
+    }
     return ptr;
   }
   if (sz == 0) {
-    CUSTOM_FREE (ptr);
+    if (fromLoader (caller)) {
+      xxfree_note (ptr, caller);
+    }
+    xxfree (ptr);
 #if defined(__APPLE__)
     // 0 size = free. We return a small object.  This behavior is
     // apparently required under Mac OS X and optional under POSIX.
@@ -264,28 +318,17 @@ extern "C" void * MYCDECL CUSTOM_REALLOC (void * ptr, size_t sz)
 #endif
   }
 
-  size_t objSize = CUSTOM_GETSIZE (ptr);
-
-  void * buf = CUSTOM_MALLOC(sz);
-
-  if (buf != NULL) {
-    if (objSize == CUSTOM_GETSIZE(buf)) {
-      // The objects are the same actual size.
-      // Free the new object and return the original.
-      CUSTOM_FREE (buf);
-      return ptr;
-    }
-    // Copy the contents of the original object
-    // up to the size of the new block.
-    size_t minSize = (objSize < sz) ? objSize : sz;
-    memcpy (buf, ptr, minSize);
+  if (sz >> (sizeof(size_t) * 8 - 1)) {
+    return NULL;
   }
 
-  // Free the old block.
-  CUSTOM_FREE (ptr);
-
-  // Return a pointer to the new one.
-  return buf;
+  // Resizes in place when it can, copies otherwise.
+  void * newPtr = xxrealloc (ptr, sz);
+  if (newPtr && fromLoader (caller)) {
+    xxfree_note (ptr, caller);
+    xxmalloc_note (newPtr, caller);
+  }
+  return newPtr;
 }
 
 #if defined(__linux)
@@ -350,13 +393,12 @@ extern "C" int  CUSTOM_MALLOPT (int /* param */, int /* value */) {
   return 1; // success.
 }
 
-extern "C" int CUSTOM_MALLOC_TRIM(size_t /* pad */) {
-  // NOP.
-  return 0; // no memory returned to OS.
+extern "C" int CUSTOM_MALLOC_TRIM(size_t pad) {
+  return xxmalloc_trim(pad);
 }
 
 extern "C" void CUSTOM_MALLOC_STATS(void) {
-  // NOP.
+  xxmalloc_stats();
 }
 
 extern "C" void * CUSTOM_MALLOC_GET_STATE(void) {
@@ -471,6 +513,59 @@ void operator delete[](void * ptr, size_t)
 }
 #endif
 
+#if defined(__cpp_aligned_new) && __cpp_aligned_new >= 201606
+
+void * operator new (size_t sz, std::align_val_t al)
+{
+  void * ptr = CUSTOM_MEMALIGN ((size_t) al, sz);
+  if (ptr == NULL) {
+    throw std::bad_alloc();
+  } else {
+    return ptr;
+  }
+}
+
+void * operator new[] (size_t sz, std::align_val_t al)
+{
+  void * ptr = CUSTOM_MEMALIGN ((size_t) al, sz);
+  if (ptr == NULL) {
+    throw std::bad_alloc();
+  } else {
+    return ptr;
+  }
+}
+
+void * operator new (size_t sz, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+  return CUSTOM_MEMALIGN ((size_t) al, sz);
+}
+
+void * operator new[] (size_t sz, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+  return CUSTOM_MEMALIGN ((size_t) al, sz);
+}
+
+void operator delete (void * ptr, std::align_val_t) noexcept
+{
+  CUSTOM_FREE (ptr);
+}
+
+void operator delete[] (void * ptr, std::align_val_t) noexcept
+{
+  CUSTOM_FREE (ptr);
+}
+
+void operator delete (void * ptr, size_t, std::align_val_t) noexcept
+{
+  CUSTOM_FREE (ptr);
+}
+
+void operator delete[] (void * ptr, size_t, std::align_val_t) noexcept
+{
+  CUSTOM_FREE (ptr);
+}
+#endif
+
 #endif
 #endif
 